@@ -5,7 +5,12 @@ from .extern import make_asimov_data as _make_asimov_data
 def make_asimov_data(workspace,
                      mu=1., profile=False,
                      toy=False,
+                     fit_summary=None,
                      **fit_params):
+    # fit_summary: optional .json or .root file receiving the
+    # status, strategy, call count and timing of the conditioning fit
+    # with HHSTAT_ASIMOV_CACHE set to a ROOT file, profiled datasets are
+    # read from / written to that file instead of refitting (AsimovCache.h)
     floating_profile_mu = False
     profile_mu = 1.
     if isinstance(profile, basestring):
@@ -37,7 +42,10 @@ def make_asimov_data(workspace,
     asimov = _make_asimov_data(workspace, model_config,
                                toy, obs_nll,
                                mu, profile_mu,
-                               floating_profile_mu)
+                               floating_profile_mu,
+                               None, None, 0, None, None,
+                               fit_summary or '',
+                               data if profile else None)
     # reset workspace
     workspace.loadSnapshot('nominal_globs')
     workspace.loadSnapshot('nominal_nuis')
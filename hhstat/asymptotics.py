@@ -2,8 +2,15 @@ from rootpy import asrootpy
 from .extern import AsymptoticsCLs
 
 
-def asymptotic_CLs(workspace, observed=False, verbose=False):
-    calculator = AsymptoticsCLs(workspace, verbose)
+def asymptotic_CLs(workspace, observed=False, verbose=False, parallel=False,
+                   fit_summary=None, flat_nll=False):
+    # with parallel=True the bands and the observed limit are computed
+    # in forked worker processes once the median limit is known
+    # with flat_nll=True the fits use the flattened binned likelihood
+    calculator = AsymptoticsCLs(workspace, verbose, parallel, flat_nll)
     hist = asrootpy(calculator.run('ModelConfig', 'obsData', 'asimovData'))
     hist.SetName('%s_limit' % workspace.GetName())
+    if fit_summary is not None:
+        # status, strategy, call count and timing of every fit
+        calculator.writeFitSummary(fit_summary)
     return hist
@@ -0,0 +1,264 @@
+# ---> python imports
+from math import ceil, exp, sqrt
+import json
+import os
+import random
+from Queue import Empty
+import resource
+import tempfile
+import time
+
+# ---> root/rootpy imports
+from rootpy.io import root_open
+from rootpy.plotting import Hist
+from rootpy.stats.histfactory import (
+    Sample, Channel, Measurement, HistoSys, OverallSys, make_workspace)
+
+# ---> local imports
+from .parallel import Worker, run_pool
+from . import log; log = log[__name__]
+
+POI = 'SigXsecOverSM'
+
+STAGES = [
+    'minimize',
+    'make_asimov_data',
+    'significance_observed',
+    'significance_asimov',
+    'asymptotic_cls',
+]
+
+
+# ------------------------------------------------
+def make_synthetic_workspace(n_channels=1, n_bins=10, n_samples=3,
+                             n_alphas=5, n_gammas=None, seed=0,
+                             name='combined'):
+    """
+    Build a HistFactory workspace of the requested size
+    - Parameters:
+    - n_channels: number of channels
+    - n_bins: number of bins per channel
+    - n_samples: number of samples per channel, the first one is the signal
+    - n_alphas: number of alpha_* NPs, NP i is an OverallSys (and a
+      HistoSys tilt for odd i) of background i % (n_samples - 1) in every channel
+    - n_gammas: number of gamma_stat parameters, rounded up to whole channels
+      of n_bins (all channels if None)
+    - seed: seed of the yields, the uncertainties and the data
+    """
+    rand = random.Random(seed)
+    n_backgrounds = max(n_samples - 1, 0)
+    if n_gammas is None:
+        n_stat_channels = n_channels
+    else:
+        n_stat_channels = min(n_channels, int(ceil(float(n_gammas) / n_bins)))
+    np_sizes = [(rand.uniform(0.02, 0.1), rand.uniform(0.05, 0.2))
+                for i in xrange(n_alphas)]
+    meas = Measurement('synthetic_{0}'.format(name))
+    for ichan in xrange(n_channels):
+        chan_name = 'channel{0}'.format(ichan)
+        channel = Channel(chan_name)
+        total = [0.] * n_bins
+        samples = []
+        for isample in xrange(n_samples):
+            signal = isample == 0
+            sample_name = 'Signal' if signal else 'Bkg{0}'.format(isample - 1)
+            nominal = Hist(n_bins, 0, 1,
+                           name='{0}_{1}'.format(chan_name, sample_name))
+            if signal:
+                norm = rand.uniform(5, 20)
+                shape = [exp(-0.5 * ((nominal.GetBinCenter(i + 1) - 0.5) / 0.15) ** 2)
+                         for i in xrange(n_bins)]
+            else:
+                norm = rand.uniform(100, 500)
+                slope = rand.uniform(1, 4)
+                shape = [exp(-slope * nominal.GetBinCenter(i + 1))
+                         for i in xrange(n_bins)]
+            scale = norm / sum(shape)
+            for i in xrange(n_bins):
+                content = scale * shape[i]
+                nominal.SetBinContent(i + 1, content)
+                nominal.SetBinError(i + 1, 0.1 * content)
+                total[i] += content
+            sample = Sample(sample_name, nominal)
+            if signal:
+                sample.AddNormFactor(POI, 1., -10., 10., False)
+            elif ichan < n_stat_channels:
+                sample.ActivateStatError()
+            samples.append(sample)
+        for inp, (rate, tilt) in enumerate(np_sizes):
+            if not n_backgrounds:
+                break
+            sample = samples[1 + inp % n_backgrounds]
+            np_name = 'ATLAS_synthetic_{0}'.format(inp)
+            sample.AddOverallSys(OverallSys(np_name, low=1. - rate, high=1. + rate))
+            if inp % 2:
+                nominal = sample.hist
+                high = nominal.Clone(name=nominal.GetName() + '_' + np_name + '_high')
+                low = nominal.Clone(name=nominal.GetName() + '_' + np_name + '_low')
+                for i in xrange(n_bins):
+                    shift = tilt * (nominal.GetBinCenter(i + 1) - 0.5)
+                    high.SetBinContent(i + 1, nominal.GetBinContent(i + 1) * (1. + shift))
+                    low.SetBinContent(i + 1, nominal.GetBinContent(i + 1) * (1. - shift))
+                sample.AddHistoSys(HistoSys(np_name, low=low, high=high))
+        for sample in samples:
+            channel.AddSample(sample)
+        data = Hist(n_bins, 0, 1, name='{0}_data'.format(chan_name))
+        for i in xrange(n_bins):
+            data.SetBinContent(i + 1, poisson(rand, total[i]))
+        channel.SetData(data)
+        channel.SetStatErrorConfig(0., 'Poisson')
+        meas.AddChannel(channel)
+    meas.SetPOI(POI)
+    meas.SetLumi(1.)
+    meas.SetLumiRelErr(0.)
+    meas.AddConstantParam('Lumi')
+    return make_workspace(meas, name=name, silence=True)
+
+
+def poisson(rand, mean):
+    # gaussian approximation above 100 to keep it cheap
+    if mean > 100:
+        return max(0, int(round(rand.gauss(mean, sqrt(mean)))))
+    limit, k, prod = exp(-mean), 0, rand.random()
+    while prod > limit:
+        k += 1
+        prod *= rand.random()
+    return k
+
+
+# ------------------------------------------------
+def count_params(ws):
+    """
+    Numbers of floating alpha_* and gamma_stat parameters and of bins
+    """
+    mc = ws.obj('ModelConfig')
+    counts = {'alpha': 0, 'gamma_stat': 0, 'other': 0}
+    itr = mc.GetNuisanceParameters().createIterator()
+    while True:
+        par = itr.Next()
+        if not par:
+            break
+        if par.isConstant():
+            continue
+        if par.GetName().startswith('alpha_'):
+            counts['alpha'] += 1
+        elif 'gamma_stat' in par.GetName():
+            counts['gamma_stat'] += 1
+        else:
+            counts['other'] += 1
+    counts['bins'] = int(ws.data('obsData').numEntries())
+    return counts
+
+
+# ------------------------------------------------
+def read_fit_summary(file_name):
+    """
+    Number of fits, NLL evaluations and failures of a .json fit summary
+    """
+    if not os.path.exists(file_name) or not os.path.getsize(file_name):
+        return 0, 0, 0
+    with open(file_name) as summary_file:
+        fits = json.load(summary_file)
+    return (len(fits),
+            sum(fit['calls'] for fit in fits),
+            sum(1 for fit in fits if fit['status'] not in (0, 1)))
+
+
+class StageWorker(Worker):
+    """
+    Time one stage in a fresh process so that its peak RSS
+    is not polluted by the previous stages
+    """
+    def __init__(self, file_name, ws_name, stage, flat_nll=False):
+        super(StageWorker, self).__init__()
+        self.file_name = file_name
+        self.ws_name = ws_name
+        self.stage = stage
+        self.flat_nll = flat_nll
+
+    def work(self):
+        # cache hits skip the conditioning fits, time the fits themselves
+        asimov_cache = os.environ.pop('HHSTAT_ASIMOV_CACHE', None)
+        # importing hhstat.extern compiles and loads every macro,
+        # which must not be counted in the stage
+        stage = self.load_stage()
+        fd, summary = tempfile.mkstemp(suffix='.json')
+        os.close(fd)
+        try:
+            with root_open(self.file_name) as file:
+                ws = file[self.ws_name]
+                rss_before = resource.getrusage(resource.RUSAGE_SELF).ru_maxrss
+                wall, cpu = time.time(), time.clock()
+                ok = stage(ws, summary)
+                wall, cpu = time.time() - wall, time.clock() - cpu
+            nr_minimize, nll_evals, failures = read_fit_summary(summary)
+        finally:
+            os.remove(summary)
+        # kilobytes on Linux
+        rss = resource.getrusage(resource.RUSAGE_SELF).ru_maxrss
+        return {
+            'ok': ok,
+            'wall_time': wall,
+            'cpu_time': cpu,
+            'nr_minimize': nr_minimize,
+            'nll_evaluations': nll_evals,
+            'failed_fits': failures,
+            'peak_rss_mb': rss / 1024.,
+            # peak before the stage: libraries and workspace
+            'baseline_rss_mb': rss_before / 1024.,
+            # HHSTAT_ASIMOV_CACHE of the environment, ignored by the stage
+            'asimov_cache': asimov_cache,
+        }
+
+    def load_stage(self):
+        """
+        Import the wrappers of the stage and return a function of (ws, summary)
+        """
+        from .extern import benchmark_minimize
+        from .asimov import make_asimov_data
+        from .significance import significance
+        from .asymptotics import asymptotic_CLs
+        stage, flat_nll = self.stage, self.flat_nll
+        if stage == 'minimize':
+            return lambda ws, summary: benchmark_minimize(ws, summary, flat_nll) in (0, 1)
+        if stage == 'make_asimov_data':
+            return lambda ws, summary: bool(
+                make_asimov_data(ws, mu=1., profile=True, fit_summary=summary))
+        if stage in ('significance_observed', 'significance_asimov'):
+            def run(ws, summary):
+                significance(ws, observed=stage == 'significance_observed',
+                             fit_summary=summary, flat_nll=flat_nll)
+                return True
+            return run
+        if stage == 'asymptotic_cls':
+            def run(ws, summary):
+                asymptotic_CLs(ws, fit_summary=summary, flat_nll=flat_nll)
+                return True
+            return run
+        raise ValueError("unknown stage {0}".format(stage))
+
+
+# ------------------------------------------------
+def benchmark(file_name, ws_name='combined', stages=None, flat_nll=False):
+    """
+    Run the stages one after the other, each in its own process,
+    and return {stage: metrics}
+    """
+    results = {}
+    for stage in stages or STAGES:
+        worker = StageWorker(file_name, ws_name, stage, flat_nll=flat_nll)
+        run_pool([worker], n_jobs=1)
+        # a crashed stage (e.g. a segfault in ROOT) never fills the queue
+        if worker.exitcode != 0:
+            results[stage] = {'ok': False, 'exitcode': worker.exitcode}
+        else:
+            try:
+                results[stage] = worker.result.get(timeout=10)
+            except Empty:
+                results[stage] = {'ok': False, 'exitcode': worker.exitcode}
+        log.info('{0}: {1:.2f} s, {2} fits, {3} NLL evaluations, {4:.0f} MB'.format(
+            stage, results[stage].get('wall_time', -1),
+            results[stage].get('nr_minimize', 0),
+            results[stage].get('nll_evaluations', 0),
+            results[stage].get('peak_rss_mb', 0)))
+    return results
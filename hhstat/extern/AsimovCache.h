@@ -0,0 +1,315 @@
+/*
+Description: Persistent cache of Asimov datasets and conditional snapshots, used by runSig.C,
+new_runSig.C and AsymptoticsCLs.C on their conditional paths only. An Asimov dataset built without
+a conditioning fit (as in FitCrossCheckForLimits.C) is cheaper to rebuild than to hash and load.
+
+The cache is a side ROOT file named by the HHSTAT_ASIMOV_CACHE environment variable (disabled when
+unset or empty). Each entry is a directory named after the MD5 of
+- the model: the classes and names of all pdf components, the value of every constant leaf (this
+  includes the global observables), the ranges of the floating ones, the observable binning, and
+  the expected yield of every bin at two fixed points of the floating parameters, so that changed
+  templates or interpolation settings give a new key even when all the names are unchanged
+- the data the conditioning fit runs on (every row and weight)
+- the arguments: mu, profiled mu, conditional flag, floating profiled mu and injected mu
+It holds the Asimov dataset and the conditional global observables and nuisance parameters.
+load() registers the snapshots in the workspace under the names the caller uses, so the rest of
+the macro does not know whether the fit ran.
+
+The file is locked with flock() on <file>.lock, so parallel workers can share one cache.
+Only successful conditioning fits are stored.
+*/
+
+#ifndef HHSTAT_ASIMOVCACHE_H
+#define HHSTAT_ASIMOVCACHE_H
+
+#include "TDirectory.h"
+#include "TFile.h"
+#include "TMD5.h"
+#include "TNamed.h"
+#include "TROOT.h"
+#include "TString.h"
+#include "TSystem.h"
+
+#include "RooAbsCategory.h"
+#include "RooAbsData.h"
+#include "RooAbsPdf.h"
+#include "RooAbsReal.h"
+#include "RooArgList.h"
+#include "RooArgSet.h"
+#include "RooCatType.h"
+#include "RooCategory.h"
+#include "RooDataSet.h"
+#include "RooRealVar.h"
+#include "RooSimultaneous.h"
+#include "RooWorkspace.h"
+#include "RooStats/ModelConfig.h"
+
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+
+class AsimovCache
+{
+    public:
+
+    AsimovCache(RooWorkspace* _w, RooStats::ModelConfig* _mc, const char* _fileName = NULL):
+        w(_w),
+        mc(_mc),
+        fileName(_fileName ? _fileName : getenv("HHSTAT_ASIMOV_CACHE"))
+        {}
+
+    bool enabled() const { return w && mc && fileName.Length(); }
+    const TString& file() const { return fileName; }
+
+    // MD5 of the model, of the conditioning data and of the arguments
+    TString key(RooAbsData* conditioningData,
+            double muVal, double muValProfile,
+            bool conditional, bool floatingProfile = false,
+            double muInjection = -1)
+    {
+        TMD5 md5;
+        update(md5, "hhstat-asimov-cache-1");
+        hashModel(md5, floatingProfile);
+        hashData(md5, conditioningData);
+        description = Form("mu=%.6g mu_profile=%.6g conditional=%d floating_profile=%d mu_injection=%.6g",
+                muVal, muValProfile, (int)conditional, (int)floatingProfile, muInjection);
+        update(md5, description);
+        md5.Final();
+        return md5.AsString();
+    }
+
+    // new dataset named dataName, NULL on a miss; the conditional snapshots are saved in the
+    // workspace under globsName and nuisName (when given), the parameter values are untouched
+    RooDataSet* load(const TString& key, const char* dataName,
+            const char* globsName = NULL, const char* nuisName = NULL)
+    {
+        if (!enabled() || gSystem->AccessPathName(fileName)) return NULL;
+        int lockFd = lock(LOCK_SH);
+        TDirectory* savedDir = gDirectory;
+        TFile* f = TFile::Open(fileName, "READ");
+        RooDataSet* result = NULL;
+        if (f && !f->IsZombie())
+        {
+            TDirectory* dir = f->GetDirectory(key);
+            RooDataSet* cached = dir ? (RooDataSet*)dir->Get("asimov_data") : NULL;
+            RooArgSet* globs = dir ? (RooArgSet*)dir->Get("conditional_globs") : NULL;
+            RooArgSet* nuis = dir ? (RooArgSet*)dir->Get("conditional_nuis") : NULL;
+            if (cached && (!globsName || globs) && (!nuisName || nuis))
+            {
+                gROOT->cd();
+                result = new RooDataSet(*cached, dataName);
+                if (globsName) w->saveSnapshot(globsName, *globs, kTRUE);
+                if (nuisName) w->saveSnapshot(nuisName, *nuis, kTRUE);
+                std::cout << "Loaded " << dataName << " from the Asimov cache " << fileName << " (" << key << ")" << std::endl;
+            }
+            delete cached;
+            delete globs;
+            delete nuis;
+        }
+        delete f;
+        savedDir->cd();
+        unlock(lockFd);
+        return result;
+    }
+
+    // store the dataset and the workspace snapshots globsName and nuisName (when given)
+    bool store(const TString& key, RooDataSet* data,
+            const char* globsName = NULL, const char* nuisName = NULL)
+    {
+        if (!enabled() || !data) return false;
+        const RooArgSet* globs = globsName ? w->getSnapshot(globsName) : NULL;
+        const RooArgSet* nuis = nuisName ? w->getSnapshot(nuisName) : NULL;
+        if ((globsName && !globs) || (nuisName && !nuis))
+        {
+            std::cout << "WARNING::Missing conditional snapshot, not caching " << data->GetName() << std::endl;
+            return false;
+        }
+        int lockFd = lock(LOCK_EX);
+        TDirectory* savedDir = gDirectory;
+        TFile* f = TFile::Open(fileName, "UPDATE");
+        bool stored = false;
+        if (!f || f->IsZombie())
+        {
+            std::cout << "WARNING::Can't open the Asimov cache " << fileName << std::endl;
+        }
+        else if (!f->GetDirectory(key))
+        {
+            TDirectory* dir = f->mkdir(key);
+            TNamed arguments("arguments", description.Data());
+            dir->WriteTObject(&arguments);
+            dir->WriteTObject(data, "asimov_data");
+            if (globs) dir->WriteTObject(globs, "conditional_globs");
+            if (nuis) dir->WriteTObject(nuis, "conditional_nuis");
+            stored = true;
+        }
+        delete f;
+        savedDir->cd();
+        unlock(lockFd);
+        return stored;
+    }
+
+    private:
+
+    static void update(TMD5& md5, const TString& s)
+    {
+        md5.Update((const UChar_t*)s.Data(), s.Length() + 1);
+    }
+
+    static void update(TMD5& md5, double x)
+    {
+        update(md5, TString(Form("%.10g", x)));
+    }
+
+    void hashModel(TMD5& md5, bool floatingProfile)
+    {
+        RooAbsPdf* pdf = mc->GetPdf();
+        RooRealVar* poi = (RooRealVar*)mc->GetParametersOfInterest()->first();
+
+        RooArgSet* components = pdf->getComponents();
+        RooArgList branches(*components);
+        branches.sort();
+        for (int i = 0; i < branches.getSize(); i++)
+        {
+            update(md5, branches.at(i)->ClassName());
+            update(md5, branches.at(i)->GetName());
+        }
+        delete components;
+
+        RooArgSet leafSet;
+        pdf->leafNodeServerList(&leafSet);
+        RooArgList leaves(leafSet);
+        leaves.sort();
+        RooArgList floating;
+        for (int i = 0; i < leaves.getSize(); i++)
+        {
+            RooAbsArg* leaf = leaves.at(i);
+            update(md5, leaf->ClassName());
+            update(md5, leaf->GetName());
+            RooRealVar* var = dynamic_cast<RooRealVar*>(leaf);
+            RooAbsCategory* cat = dynamic_cast<RooAbsCategory*>(leaf);
+            if (var && mc->GetObservables()->find(*var))
+            {
+                update(md5, var->getMin());
+                update(md5, var->getMax());
+                update(md5, (double)var->numBins());
+            }
+            else if (var == poi)
+            {
+                // the constant flag of the POI is set by the callers, only the range of a
+                // floating profiled mu matters
+                if (!floatingProfile) continue;
+                update(md5, var->getMin());
+                update(md5, var->getMax());
+                floating.add(*var);
+            }
+            else if (var && !var->isConstant())
+            {
+                update(md5, var->getMin());
+                update(md5, var->getMax());
+                floating.add(*var);
+            }
+            else if (cat)
+            {
+                update(md5, (double)cat->numTypes());
+            }
+            else if (RooAbsReal* real = dynamic_cast<RooAbsReal*>(leaf))
+            {
+                update(md5, real->getVal());
+            }
+        }
+
+        // expected yields at two fixed points of the floating parameters (and of the POI)
+        if (!floating.find(*poi)) floating.add(*poi);
+        RooArgSet* saved = (RooArgSet*)leaves.snapshot();
+        double fractions[2] = {0.37, 0.71};
+        for (int p = 0; p < 2; p++)
+        {
+            for (int i = 0; i < floating.getSize(); i++)
+            {
+                RooRealVar* var = (RooRealVar*)floating.at(i);
+                if (var->hasMin() && var->hasMax())
+                    var->setVal(var->getMin() + fractions[p] * (var->getMax() - var->getMin()));
+            }
+            RooSimultaneous* simPdf = dynamic_cast<RooSimultaneous*>(pdf);
+            if (!simPdf)
+            {
+                hashYields(md5, pdf);
+                continue;
+            }
+            RooCategory* channelCat = (RooCategory*)&simPdf->indexCat();
+            TIterator* iter = channelCat->typeIterator();
+            RooCatType* tt = NULL;
+            while ((tt = (RooCatType*)iter->Next()))
+            {
+                RooAbsPdf* pdftmp = simPdf->getPdf(tt->GetName());
+                update(md5, tt->GetName());
+                if (pdftmp) hashYields(md5, pdftmp);
+            }
+            delete iter;
+        }
+        leaves = *saved;
+        delete saved;
+    }
+
+    // same bin loop as makeAsimovData
+    void hashYields(TMD5& md5, RooAbsPdf* pdftmp)
+    {
+        RooArgSet* obstmp = pdftmp->getObservables(*mc->GetObservables());
+        RooRealVar* thisObs = (RooRealVar*)obstmp->first();
+        if (thisObs)
+        {
+            double expectedEvents = pdftmp->expectedEvents(*obstmp);
+            for (int jj = 0; jj < thisObs->numBins(); ++jj)
+            {
+                thisObs->setBin(jj);
+                update(md5, pdftmp->getVal(obstmp) * thisObs->getBinWidth(jj) * expectedEvents);
+            }
+        }
+        delete obstmp;
+    }
+
+    void hashData(TMD5& md5, RooAbsData* data)
+    {
+        update(md5, (double)data->numEntries());
+        for (int i = 0; i < data->numEntries(); i++)
+        {
+            const RooArgSet* row = data->get(i);
+            TIterator* itr = row->createIterator();
+            RooAbsArg* arg;
+            while ((arg = (RooAbsArg*)itr->Next()))
+            {
+                if (RooAbsCategory* cat = dynamic_cast<RooAbsCategory*>(arg))
+                    update(md5, cat->getLabel());
+                else if (RooAbsReal* real = dynamic_cast<RooAbsReal*>(arg))
+                    update(md5, real->getVal());
+            }
+            delete itr;
+            update(md5, data->weight());
+        }
+    }
+
+    int lock(int operation) const
+    {
+        int fd = open((fileName + ".lock").Data(), O_RDWR | O_CREAT, 0644);
+        if (fd >= 0) flock(fd, operation);
+        return fd;
+    }
+
+    static void unlock(int fd)
+    {
+        if (fd < 0) return;
+        flock(fd, LOCK_UN);
+        close(fd);
+    }
+
+    RooWorkspace* w;
+    RooStats::ModelConfig* mc;
+    TString fileName;
+    TString description;
+};
+
+#endif
@@ -0,0 +1,306 @@
+/*
+Description: Numerical engine for the asymptotic formulae of arxiv 1007.1727 used by AsymptoticsCLs.
+
+CLs(qmu | mu, sigma) only depends on qmu and r = |mu/sigma|. The qmu95 crossing CLs(qmu95) = target
+is therefore tabulated on a grid in r the first time a target CLs is requested and linearly
+interpolated afterwards. All nodes of a table are solved together with a batched bisection so that
+the erfc evaluations run over contiguous arrays. Points outside of the table, and next to the
+qmuMax saturation where qmu95 is too steep to interpolate, fall back to a direct bisection.
+validate() compares the table to a copy of the brute force scan that AsymptoticsCLs used to fall
+back on, still built on the old pmu/(1-pb) CLs, and reports the largest deviation.
+
+CLs is computed as a ratio of upper tails in log space instead of pmu/(1-pb) with 1 - gaussian_cdf.
+The old form underflows to 0/0 for |mu/sigma| below ~0.5, where both the Newton iteration and the
+brute force scan returned numerical noise.
+*/
+
+#ifndef HHSTAT_ASYMPTOTICFORMULAE_H
+#define HHSTAT_ASYMPTOTICFORMULAE_H
+
+#include "TMath.h"
+#include "Math/ProbFuncMathCore.h"
+#include "Math/QuantFuncMathCore.h"
+
+#include <cmath>
+#include <map>
+#include <vector>
+#include <iostream>
+
+class AsymptoticFormulae
+{
+    public:
+
+    AsymptoticFormulae(bool _doTilde = true, double _precision = 0.005):
+        doTilde(_doTilde),
+        precision(_precision),
+        tableStep(0.01),
+        tableMax(10.),
+        qmuMax(20.),
+        bruteStep(0.001),
+        legacyMin(0.45)
+        {}
+
+    // upper tail of the unit gaussian, 1 - gaussian_cdf(x)
+    static double tail(double x)
+    {
+        return 0.5*erfc(x*M_SQRT1_2);
+    }
+
+    // log of the upper tail, asymptotic series where erfc underflows
+    static double logTail(double x)
+    {
+        if (x < 8) return log(0.5*erfc(x*M_SQRT1_2));
+        double x2 = 1./(x*x);
+        return -0.5*x*x - log(x) - 0.5*log(2*M_PI) + log(1 - x2 + 3*x2*x2 - 15*x2*x2*x2);
+    }
+
+    double calcPmu(double qmu, double sigma, double mu) const
+    {
+        return pmu(qmu, fabs(mu/sigma));
+    }
+
+    // returns 1-pb, like AsymptoticsCLs always did
+    double calcPb(double qmu, double sigma, double mu) const
+    {
+        return onempb(qmu, fabs(mu/sigma));
+    }
+
+    double calcCLs(double qmu, double sigma, double mu) const
+    {
+        return cls(qmu, fabs(mu/sigma));
+    }
+
+    double calcDerCLs(double qmu, double sigma, double mu) const
+    {
+        double r = fabs(mu/sigma);
+        double dpmu_dq = 0;
+        double d1mpb_dq = 0;
+        if (qmu < r*r)
+        {
+            double zmu = sqrt(qmu);
+            dpmu_dq = -1./(2*sqrt(qmu*2*TMath::Pi()))*exp(-zmu*zmu/2);
+            double zb = r-sqrt(qmu);
+            d1mpb_dq = -1./sqrt(qmu*2*TMath::Pi())*exp(-zb*zb/2);
+        }
+        else
+        {
+            double zmu = (qmu+r*r)/(2*r);
+            dpmu_dq = -1./(2*r)*1./(sqrt(2*TMath::Pi()))*exp(-zmu*zmu/2);
+            double zb = (r*r - qmu)/(2*r);
+            d1mpb_dq = -1./(2*r)*1./(sqrt(2*TMath::Pi()))*exp(-zb*zb/2);
+        }
+        double pb = onempb(qmu, r);
+        return dpmu_dq/(1-pb)-cls(qmu, r)/(1-pb)*d1mpb_dq;
+    }
+
+    // batched versions, r[i] = |mu/sigma| for the i-th point
+    void calcPmu(const double* qmu, const double* r, int n, double* out) const
+    {
+        for (int i=0;i<n;i++)
+        {
+            bool tilde = doTilde && qmu[i] >= r[i]*r[i];
+            double z = tilde ? (qmu[i]+r[i]*r[i])/(2*r[i]) : sqrt(qmu[i]);
+            out[i] = 0.5*erfc(z*M_SQRT1_2);
+        }
+    }
+
+    void calcPb(const double* qmu, const double* r, int n, double* out) const
+    {
+        for (int i=0;i<n;i++)
+        {
+            bool tilde = doTilde && qmu[i] >= r[i]*r[i];
+            double z = tilde ? (r[i]*r[i]-qmu[i])/(2*r[i]) : r[i]-sqrt(qmu[i]);
+            out[i] = 0.5*erfc(z*M_SQRT1_2);
+        }
+    }
+
+    void calcCLs(const double* qmu, const double* r, int n, double* out) const
+    {
+        for (int i=0;i<n;i++)
+        {
+            bool tilde = doTilde && qmu[i] >= r[i]*r[i];
+            double zmu = tilde ? (qmu[i]+r[i]*r[i])/(2*r[i]) : sqrt(qmu[i]);
+            double zb  = tilde ? (r[i]*r[i]-qmu[i])/(2*r[i]) : r[i]-sqrt(qmu[i]);
+            // 1-(1-pb) is the opposite tail, take the ratio in log space
+            out[i] = exp(logTail(zmu) - logTail(-zb));
+        }
+    }
+
+    double getQmu95(double sigma, double mu, double target_CLs)
+    {
+        double r = fabs(mu/sigma);
+        if (r != r) return getQmu95_brute(sigma, mu, target_CLs);
+
+        //no sane man would venture this far down into |mu/sigma|
+        //(kept from the original getQmu95 so that limits are unchanged)
+        double target_N = ROOT::Math::gaussian_cdf(1-target_CLs,1);
+        if (r < 0.25*target_N) return 5.83/target_N;
+        if (r >= tableMax) return solve(r, target_CLs);
+
+        const std::vector<double>& table = getTable(target_CLs);
+        double x = r/tableStep;
+        int i = int(x);
+        if (i >= int(table.size())-1) return table.back();
+        // next to the qmuMax saturation qmu95(r) is too steep to interpolate, solve directly
+        double step = fabs(table[i+1] - table[i]);
+        if (qmuMax - table[i] <= step || qmuMax - table[i+1] <= step) return solve(r, target_CLs);
+        double frac = x - i;
+        return (1-frac)*table[i] + frac*table[i+1];
+    }
+
+    void getQmu95(const double* r, int n, double target_CLs, double* out)
+    {
+        for (int i=0;i<n;i++) out[i] = getQmu95(1., r[i], target_CLs);
+    }
+
+    double getQmu95_brute(double sigma, double mu, double target_CLs) const
+    {
+        double r = fabs(mu/sigma);
+        double start = bruteStep;
+        if (mu/sigma > 0.2) start = 0;
+        for (double qmu=start;qmu<qmuMax;qmu+=bruteStep)
+        {
+            if (cls(qmu, r) < target_CLs) return qmu;
+        }
+        return qmuMax;
+    }
+
+    // compare the interpolated qmu95 to the legacy brute force scan over nPoints values of
+    // |mu/sigma| and return the largest deviation in units of the allowed tolerance (<= 1 is a pass)
+    double validate(double target_CLs, int nPoints = 200, bool verbose = false)
+    {
+        double target_N = ROOT::Math::gaussian_cdf(1-target_CLs,1);
+        // the legacy tilde CLs is noise below legacyMin, there is no reference to compare to
+        double r_min = 0.25*target_N;
+        if (doTilde && r_min < legacyMin) r_min = legacyMin;
+        double r_max = 1.2*tableMax;
+        double worst = 0;
+        for (int i=0;i<nPoints;i++)
+        {
+            double r = r_min + (r_max-r_min)*(i+0.5)/nPoints;
+            double fast = getQmu95(1., r, target_CLs);
+            double brute = legacyQmu95_brute(r, target_CLs);
+            double tolerance = precision*brute + bruteStep;
+            double deviation = fabs(fast-brute)/tolerance;
+            if (deviation > worst) worst = deviation;
+            if (verbose || deviation > 1)
+            {
+                std::cout << "|mu/sigma| = " << r << ", qmu95 = " << fast
+                          << ", brute force = " << brute
+                          << (deviation > 1 ? " (outside tolerance)" : "") << std::endl;
+            }
+        }
+        return worst;
+    }
+
+    void clear()
+    {
+        tables.clear();
+    }
+
+    private:
+
+    // the calcCLs and getQmu95_brute of AsymptoticsCLs before the log space CLs, kept as the
+    // independent reference of validate()
+    double legacyCLs(double qmu, double r) const
+    {
+        double pmu, pb;
+        if (qmu < r*r || !doTilde)
+        {
+            pmu = 1-ROOT::Math::gaussian_cdf(sqrt(qmu));
+            pb = 1-ROOT::Math::gaussian_cdf(r - sqrt(qmu));
+        }
+        else
+        {
+            pmu = 1-ROOT::Math::gaussian_cdf((qmu+r*r)/(2*r));
+            pb = 1-ROOT::Math::gaussian_cdf((r*r - qmu)/(2*r));
+        }
+        if (pb == 1) return 0.5;
+        return pmu/(1-pb);
+    }
+
+    double legacyQmu95_brute(double r, double target_CLs) const
+    {
+        double start = bruteStep;
+        if (r > 0.2) start = 0;
+        for (double qmu=start;qmu<qmuMax;qmu+=bruteStep)
+        {
+            if (legacyCLs(qmu, r) < target_CLs) return qmu;
+        }
+        return qmuMax;
+    }
+
+    double pmu(double qmu, double r) const
+    {
+        if (qmu < r*r || !doTilde) return tail(sqrt(qmu));
+        return tail((qmu+r*r)/(2*r));
+    }
+
+    double onempb(double qmu, double r) const
+    {
+        if (qmu < r*r || !doTilde) return tail(r - sqrt(qmu));
+        return tail((r*r - qmu)/(2*r));
+    }
+
+    double cls(double qmu, double r) const
+    {
+        if (qmu < r*r || !doTilde) return exp(logTail(sqrt(qmu)) - logTail(sqrt(qmu) - r));
+        return exp(logTail((qmu + r*r)/(2*r)) - logTail((qmu - r*r)/(2*r)));
+    }
+
+    // direct bisection of CLs(qmu) = target_CLs on [0, qmuMax]
+    double solve(double r, double target_CLs) const
+    {
+        double lo = 0;
+        double hi = qmuMax;
+        if (cls(hi, r) >= target_CLs) return qmuMax;
+        while (hi-lo > 1e-7*hi)
+        {
+            double mid = 0.5*(lo+hi);
+            if (cls(mid, r) < target_CLs) hi = mid;
+            else lo = mid;
+        }
+        return hi;
+    }
+
+    const std::vector<double>& getTable(double target_CLs)
+    {
+        std::map<double, std::vector<double> >::iterator itr = tables.find(target_CLs);
+        if (itr != tables.end()) return itr->second;
+
+        int n = int(tableMax/tableStep + 0.5) + 1;
+        std::vector<double> r(n), lo(n, 0.), hi(n, qmuMax), mid(n), val(n);
+        for (int i=0;i<n;i++) r[i] = i*tableStep;
+        // r = 0 is singular in the tilde formula, the legacy cutoff never reaches it
+        r[0] = 0.5*tableStep;
+
+        calcCLs(&hi[0], &r[0], n, &val[0]);
+        std::vector<bool> saturated(n);
+        for (int i=0;i<n;i++) saturated[i] = val[i] >= target_CLs;
+
+        // 40 halvings of [0, 20] resolve qmu95 far below the brute force step
+        for (int itr=0;itr<40;itr++)
+        {
+            for (int i=0;i<n;i++) mid[i] = 0.5*(lo[i]+hi[i]);
+            calcCLs(&mid[0], &r[0], n, &val[0]);
+            for (int i=0;i<n;i++)
+            {
+                if (val[i] < target_CLs) hi[i] = mid[i];
+                else lo[i] = mid[i];
+            }
+        }
+        for (int i=0;i<n;i++) if (saturated[i]) hi[i] = qmuMax;
+        return tables[target_CLs] = hi;
+    }
+
+    bool doTilde;
+    double precision;
+    double tableStep;
+    double tableMax;
+    double qmuMax;
+    double bruteStep;
+    double legacyMin; // below this |mu/sigma| the legacy brute force scan is numerical noise with doTilde
+    std::map<double, std::vector<double> > tables;
+};
+
+#endif
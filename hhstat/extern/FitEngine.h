@@ -0,0 +1,574 @@
+/*
+Description: Minimization core shared by runSig.C, new_runSig.C, AsymptoticsCLs.C and the NP drivers.
+
+The retry ladder is the one all three macros used to carry: climb the Minuit strategy up to
+maxStrategy, then switch between Minuit2 and Minuit and climb again, then optionally reload
+workspace snapshots and start over. Parameters held constant for the fit keep their value when a
+retry snapshot is loaded. Unlike the old minimize() functions, the minimizer options
+live in the FitOptions of each call and the global ROOT::Math::MinimizerOptions are never touched,
+so several engines can be used side by side.
+
+Functions implementing FitGradient (FlatBinnedNLL.h) are minimized through ROOT::Math::Minimizer
+with their analytic gradient, using the same ladder. Set FitOptions::gradient to false to
+use RooMinimizer and numerical derivatives for them as well.
+
+Every call to minimize() appends a FitRecord (wall/cpu time, NLL evaluations, strategy reached,
+minimizer switches, snapshot retries and final status). The records can be printed, exported as
+a TTree or as JSON, and shipped between processes with serialize()/merge().
+*/
+
+#ifndef HHSTAT_FITENGINE_H
+#define HHSTAT_FITENGINE_H
+
+#include "TFile.h"
+#include "TTree.h"
+#include "TString.h"
+#include "TStopwatch.h"
+
+#include "RooAbsReal.h"
+#include "RooArgSet.h"
+#include "RooRealVar.h"
+#include "RooMinimizer.h"
+#include "RooMsgService.h"
+#include "RooWorkspace.h"
+
+#include "Math/Factory.h"
+#include "Math/IFunction.h"
+#include "Math/Minimizer.h"
+#include "Math/MinimizerOptions.h"
+
+#include <string>
+#include <vector>
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <cstring>
+#include <cstdlib>
+
+struct FitOptions
+{
+    FitOptions():
+        minimizer("Minuit2"),
+        algorithm("Migrad"),
+        strategy(1),
+        maxStrategy(2),
+        printLevel(-1),
+        switchMinimizer(true),
+        switchStrategy(-1),
+        maxRetries(0),
+        gradient(true)
+        {}
+
+    std::string minimizer;                   // "Minuit2" or "Minuit"
+    std::string algorithm;
+    int strategy;                            // initial strategy, 0 = fastest, 2 = most robust
+    int maxStrategy;                         // climb the strategy up to this value on failures
+    int printLevel;                          // Minuit print level, < 0 also silences RooFit
+    bool switchMinimizer;                    // retry with the other Minuit when the ladder fails
+    int switchStrategy;                      // strategy to restart from after a switch (-1 = strategy)
+    int maxRetries;                          // number of snapshot retries after the ladder fails
+    std::vector<std::string> retrySnapshots; // workspace snapshots to reload, one per retry
+    bool gradient;                           // use the analytic gradient of FitGradient functions
+};
+
+// implemented by functions that provide their own gradient
+class FitGradient
+{
+    public:
+    virtual ~FitGradient() {}
+    virtual bool hasGradient() const = 0;
+    // derivatives with respect to params, in that order
+    virtual void gradient(const std::vector<RooRealVar*>& params, double* grad) = 0;
+};
+
+// a RooAbsReal with a FitGradient seen by ROOT::Math::Minimizer, counting the evaluations
+class FitGradientFunction : public ROOT::Math::IMultiGradFunction
+{
+    public:
+
+    FitGradientFunction(RooAbsReal* _fcn, FitGradient* _grad, const std::vector<RooRealVar*>& _params, int* _calls):
+        fcn(_fcn),
+        grad(_grad),
+        params(_params),
+        calls(_calls)
+        {}
+
+    ROOT::Math::IBaseFunctionMultiDim* Clone() const { return new FitGradientFunction(*this); }
+    unsigned int NDim() const { return params.size(); }
+
+    void Gradient(const double* x, double* g) const
+    {
+        set(x);
+        (*calls)++;
+        grad->gradient(params, g);
+    }
+
+    void FdF(const double* x, double& f, double* g) const
+    {
+        set(x);
+        (*calls)++;
+        f = fcn->getVal();
+        grad->gradient(params, g);
+    }
+
+    private:
+
+    double DoEval(const double* x) const
+    {
+        set(x);
+        (*calls)++;
+        return fcn->getVal();
+    }
+
+    double DoDerivative(const double* x, unsigned int icoord) const
+    {
+        std::vector<double> g(params.size());
+        Gradient(x, &g[0]);
+        return g[icoord];
+    }
+
+    void set(const double* x) const
+    {
+        for (unsigned int i=0;i<params.size();i++) if (params[i]->getVal() != x[i]) params[i]->setVal(x[i]);
+    }
+
+    RooAbsReal* fcn;
+    FitGradient* grad;
+    std::vector<RooRealVar*> params;
+    int* calls;
+};
+
+// the subset of the RooMinimizer interface used by FitEngine, for FitGradient functions
+class GradientMinimizer
+{
+    public:
+
+    GradientMinimizer(RooAbsReal* _fcn, FitGradient* _grad):
+        fcn(_fcn),
+        grad(_grad),
+        strategy(1),
+        printLevel(-1),
+        calls(0)
+    {
+        RooArgSet* vars = fcn->getParameters(RooArgSet());
+        TIterator* itr = vars->createIterator();
+        RooAbsArg* arg;
+        while ((arg = (RooAbsArg*)itr->Next()))
+        {
+            RooRealVar* var = dynamic_cast<RooRealVar*>(arg);
+            if (var && !var->isConstant()) params.push_back(var);
+        }
+        delete itr;
+        delete vars;
+    }
+
+    void setStrategy(int _strategy) { strategy = _strategy; }
+    void setPrintLevel(int _printLevel) { printLevel = _printLevel; }
+    int evalCounter() const { return calls; }
+
+    int minimize(const char* type, const char* algorithm)
+    {
+        if (params.empty()) return 0;
+        ROOT::Math::Minimizer* minim = ROOT::Math::Factory::CreateMinimizer(type, algorithm);
+        if (!minim)
+        {
+            std::cout << "ERROR::Minimizer " << type << " is not available" << std::endl;
+            return -1;
+        }
+        const unsigned int n = params.size();
+        FitGradientFunction func(fcn, grad, params, &calls);
+        minim->SetFunction(func);
+        minim->SetStrategy(strategy);
+        minim->SetPrintLevel(printLevel);
+        minim->SetErrorDef(fcn->defaultErrorLevel());
+        minim->SetTolerance(ROOT::Math::MinimizerOptions::DefaultTolerance());
+        minim->SetMaxFunctionCalls(500*n);
+        minim->SetMaxIterations(500*n);
+        for (unsigned int i=0;i<n;i++)
+        {
+            // same initial steps as RooMinimizerFcn
+            RooRealVar* var = params[i];
+            double step = var->getError();
+            if (step <= 0) step = var->hasMin() && var->hasMax() ? 0.1*(var->getMax()-var->getMin()) : 1;
+            if (var->hasMin() && var->hasMax()) minim->SetLimitedVariable(i, var->GetName(), var->getVal(), step, var->getMin(), var->getMax());
+            else if (var->hasMin()) minim->SetLowerLimitedVariable(i, var->GetName(), var->getVal(), step, var->getMin());
+            else if (var->hasMax()) minim->SetUpperLimitedVariable(i, var->GetName(), var->getVal(), step, var->getMax());
+            else minim->SetVariable(i, var->GetName(), var->getVal(), step);
+        }
+        minim->Minimize();
+        int status = minim->Status();
+        const double* x = minim->X();
+        const double* errors = minim->Errors();
+        for (unsigned int i=0;i<n;i++)
+        {
+            if (x) params[i]->setVal(x[i]);
+            if (errors) params[i]->setError(errors[i]);
+        }
+        delete minim;
+        return status;
+    }
+
+    private:
+
+    RooAbsReal* fcn;
+    FitGradient* grad;
+    std::vector<RooRealVar*> params;
+    int strategy;
+    int printLevel;
+    int calls;
+};
+
+struct FitRecord
+{
+    std::string label;
+    std::string minimizer; // minimizer of the final attempt
+    int status;
+    int strategy;          // strategy reached
+    int nrSwitches;        // minimizer switches
+    int nrAttempts;        // calls to RooMinimizer::minimize
+    int nrRetries;         // snapshot retries
+    int nrCalls;           // NLL evaluations
+    double realTime;
+    double cpuTime;
+    double minNll;
+};
+
+class FitEngine
+{
+    public:
+
+    FitEngine(const FitOptions& _options = FitOptions(), RooWorkspace* _w = NULL):
+        opts(_options),
+        w(_w)
+        {}
+
+    FitOptions& options() { return opts; }
+    void setWorkspace(RooWorkspace* _w) { w = _w; }
+
+    static bool failed(int status)
+    {
+        return status != 0 && status != 1;
+    }
+
+    int minimize(RooAbsReal* fcn, const char* label = "")
+    {
+        return minimize(fcn, opts, label);
+    }
+
+    int minimize(RooAbsReal* fcn, const FitOptions& options, const char* label = "")
+    {
+        FitRecord record;
+        record.label = label ? label : "";
+        record.status = -1;
+        record.strategy = options.strategy;
+        record.nrSwitches = 0;
+        record.nrAttempts = 0;
+        record.nrRetries = 0;
+        record.nrCalls = 0;
+        record.minimizer = options.minimizer;
+
+        TStopwatch timer;
+        timer.Start();
+
+        RooFit::MsgLevel msglevel = RooMsgService::instance().globalKillBelow();
+        if (options.printLevel < 0) RooMsgService::instance().setGlobalKillBelow(RooFit::FATAL);
+
+        int status = ladder(fcn, options, record);
+        for (int i=0;failed(status) && i<options.maxRetries;i++)
+        {
+            if (!w || i >= (int)options.retrySnapshots.size()) break;
+            const std::string& snapshot = options.retrySnapshots[i];
+            std::cout << "Fit failed with status " << status << ". Retrying from snapshot " << snapshot << std::endl;
+            loadFloating(fcn, snapshot);
+            record.nrRetries++;
+            status = ladder(fcn, options, record);
+            if (!failed(status)) std::cout << "Successful fit" << std::endl;
+        }
+        if (failed(status)) std::cout << "WARNING::Fit failure unresolved with status " << status << std::endl;
+
+        if (options.printLevel < 0) RooMsgService::instance().setGlobalKillBelow(msglevel);
+
+        timer.Stop();
+        record.status = status;
+        record.realTime = timer.RealTime();
+        record.cpuTime = timer.CpuTime();
+        record.minNll = fcn->getVal();
+        fits.push_back(record);
+        return status;
+    }
+
+    const std::vector<FitRecord>& records() const { return fits; }
+    int nrMinimize() const { return fits.size(); }
+    void reset() { fits.clear(); }
+
+    int nrFailures() const
+    {
+        int n = 0;
+        for (unsigned int i=0;i<fits.size();i++) if (failed(fits[i].status)) n++;
+        return n;
+    }
+
+    void printSummary() const
+    {
+        double realTime = 0, cpuTime = 0;
+        int nrCalls = 0, nrSwitches = 0, nrRetries = 0, nrStrat2 = 0;
+        for (unsigned int i=0;i<fits.size();i++)
+        {
+            realTime += fits[i].realTime;
+            cpuTime += fits[i].cpuTime;
+            nrCalls += fits[i].nrCalls;
+            nrSwitches += fits[i].nrSwitches;
+            nrRetries += fits[i].nrRetries;
+            if (fits[i].strategy >= 2) nrStrat2++;
+        }
+        std::cout << "--------------------------------" << std::endl;
+        std::cout << "Fit summary" << std::endl;
+        std::cout << "Fits:               " << fits.size() << std::endl;
+        std::cout << "Failures:           " << nrFailures() << std::endl;
+        std::cout << "NLL evaluations:    " << nrCalls << std::endl;
+        std::cout << "Reached strategy 2: " << nrStrat2 << std::endl;
+        std::cout << "Minimizer switches: " << nrSwitches << std::endl;
+        std::cout << "Snapshot retries:   " << nrRetries << std::endl;
+        std::cout << "Real time:          " << realTime << " s" << std::endl;
+        std::cout << "CPU time:           " << cpuTime << " s" << std::endl;
+        std::cout << "--------------------------------" << std::endl;
+    }
+
+    // the tree is attached to the current directory
+    TTree* summaryTree(const char* name = "fits") const
+    {
+        TTree* tree = new TTree(name, "fit summary");
+        char label[256], minimizer[32];
+        int status, strategy, nrSwitches, nrAttempts, nrRetries, nrCalls;
+        double realTime, cpuTime, minNll;
+        tree->Branch("label", label, "label/C");
+        tree->Branch("minimizer", minimizer, "minimizer/C");
+        tree->Branch("status", &status, "status/I");
+        tree->Branch("strategy", &strategy, "strategy/I");
+        tree->Branch("switches", &nrSwitches, "switches/I");
+        tree->Branch("attempts", &nrAttempts, "attempts/I");
+        tree->Branch("retries", &nrRetries, "retries/I");
+        tree->Branch("calls", &nrCalls, "calls/I");
+        tree->Branch("real_time", &realTime, "real_time/D");
+        tree->Branch("cpu_time", &cpuTime, "cpu_time/D");
+        tree->Branch("min_nll", &minNll, "min_nll/D");
+        for (unsigned int i=0;i<fits.size();i++)
+        {
+            const FitRecord& fit = fits[i];
+            strncpy(label, fit.label.c_str(), sizeof(label)-1);
+            label[sizeof(label)-1] = 0;
+            strncpy(minimizer, fit.minimizer.c_str(), sizeof(minimizer)-1);
+            minimizer[sizeof(minimizer)-1] = 0;
+            status = fit.status;
+            strategy = fit.strategy;
+            nrSwitches = fit.nrSwitches;
+            nrAttempts = fit.nrAttempts;
+            nrRetries = fit.nrRetries;
+            nrCalls = fit.nrCalls;
+            realTime = fit.realTime;
+            cpuTime = fit.cpuTime;
+            minNll = fit.minNll;
+            tree->Fill();
+        }
+        tree->ResetBranchAddresses();
+        return tree;
+    }
+
+    std::string summaryJSON() const
+    {
+        std::stringstream json;
+        json << std::setprecision(10);
+        json << "[";
+        for (unsigned int i=0;i<fits.size();i++)
+        {
+            const FitRecord& fit = fits[i];
+            if (i) json << ",";
+            json << "\n  {\"label\": \"" << escape(fit.label) << "\""
+                 << ", \"minimizer\": \"" << escape(fit.minimizer) << "\""
+                 << ", \"status\": " << fit.status
+                 << ", \"strategy\": " << fit.strategy
+                 << ", \"switches\": " << fit.nrSwitches
+                 << ", \"attempts\": " << fit.nrAttempts
+                 << ", \"retries\": " << fit.nrRetries
+                 << ", \"calls\": " << fit.nrCalls
+                 << ", \"real_time\": " << fit.realTime
+                 << ", \"cpu_time\": " << fit.cpuTime
+                 << ", \"min_nll\": " << number(fit.minNll) << "}";
+        }
+        json << "\n]\n";
+        return json.str();
+    }
+
+    // write the summary as a TTree named "fits" if fileName ends in .root, as JSON otherwise
+    bool writeSummary(const char* fileName) const
+    {
+        if (!fileName || !strlen(fileName)) return false;
+        if (TString(fileName).EndsWith(".root"))
+        {
+            TFile file(fileName, "recreate");
+            if (file.IsZombie()) return false;
+            TTree* tree = summaryTree();
+            tree->Write();
+            file.Close();
+            return true;
+        }
+        std::ofstream file(fileName);
+        if (!file) return false;
+        file << summaryJSON();
+        return true;
+    }
+
+    // one tab separated line per record, see merge()
+    std::string serialize() const
+    {
+        std::stringstream out;
+        out << std::setprecision(17);
+        for (unsigned int i=0;i<fits.size();i++)
+        {
+            const FitRecord& fit = fits[i];
+            out << fit.label << "\t" << fit.minimizer << "\t" << fit.status << "\t" << fit.strategy << "\t"
+                << fit.nrSwitches << "\t" << fit.nrAttempts << "\t" << fit.nrRetries << "\t" << fit.nrCalls << "\t"
+                << fit.realTime << "\t" << fit.cpuTime << "\t" << fit.minNll << "\n";
+        }
+        return out.str();
+    }
+
+    void merge(const std::string& serialized)
+    {
+        std::stringstream in(serialized);
+        std::string line;
+        while (std::getline(in, line))
+        {
+            std::vector<std::string> fields;
+            std::stringstream fieldStream(line);
+            std::string field;
+            while (std::getline(fieldStream, field, '\t')) fields.push_back(field);
+            if (fields.size() != 11) continue;
+            FitRecord fit;
+            fit.label = fields[0];
+            fit.minimizer = fields[1];
+            fit.status = atoi(fields[2].c_str());
+            fit.strategy = atoi(fields[3].c_str());
+            fit.nrSwitches = atoi(fields[4].c_str());
+            fit.nrAttempts = atoi(fields[5].c_str());
+            fit.nrRetries = atoi(fields[6].c_str());
+            fit.nrCalls = atoi(fields[7].c_str());
+            fit.realTime = atof(fields[8].c_str());
+            fit.cpuTime = atof(fields[9].c_str());
+            fit.minNll = atof(fields[10].c_str());
+            fits.push_back(fit);
+        }
+    }
+
+    private:
+
+    int ladder(RooAbsReal* fcn, const FitOptions& options, FitRecord& record)
+    {
+        FitGradient* grad = options.gradient ? dynamic_cast<FitGradient*>(fcn) : NULL;
+        if (grad && grad->hasGradient())
+        {
+            GradientMinimizer minim(fcn, grad);
+            minim.setPrintLevel(options.printLevel);
+            return climb(minim, options, record);
+        }
+        RooMinimizer minim(*fcn);
+        minim.setPrintLevel(options.printLevel);
+        return climb(minim, options, record);
+    }
+
+    template <class Minimizer>
+    int climb(Minimizer& minim, const FitOptions& options, FitRecord& record)
+    {
+        std::string type = options.minimizer;
+        int strat = options.strategy;
+        int status = attempt(minim, type, strat, options, record);
+
+        //up the strategy
+        while (failed(status) && strat < options.maxStrategy)
+        {
+            strat++;
+            std::cout << "Fit failed with status " << status << ". Retrying with strategy " << strat << std::endl;
+            status = attempt(minim, type, strat, options, record);
+        }
+
+        //switch minuit version and try again
+        if (failed(status) && options.switchMinimizer)
+        {
+            std::string newType = type == "Minuit2" ? "Minuit" : "Minuit2";
+            std::cout << "Switching minuit type from " << type << " to " << newType << std::endl;
+            type = newType;
+            record.nrSwitches++;
+            strat = options.switchStrategy < 0 ? options.strategy : options.switchStrategy;
+            status = attempt(minim, type, strat, options, record);
+
+            while (failed(status) && strat < options.maxStrategy)
+            {
+                strat++;
+                std::cout << "Fit failed with status " << status << ". Retrying with strategy " << strat << std::endl;
+                status = attempt(minim, type, strat, options, record);
+            }
+        }
+        record.nrCalls += minim.evalCounter();
+        return status;
+    }
+
+    // load a retry snapshot without moving the parameters that are held constant for this fit
+    void loadFloating(RooAbsReal* fcn, const std::string& snapshot)
+    {
+        RooArgSet* params = fcn->getParameters(RooArgSet());
+        std::vector<std::pair<RooRealVar*, double> > fixed;
+        TIterator* itr = params->createIterator();
+        RooAbsArg* arg;
+        while ((arg = (RooAbsArg*)itr->Next()))
+        {
+            RooRealVar* var = dynamic_cast<RooRealVar*>(arg);
+            if (var && var->isConstant()) fixed.push_back(std::make_pair(var, var->getVal()));
+        }
+        delete itr;
+        w->loadSnapshot(snapshot.c_str());
+        for (unsigned int i=0;i<fixed.size();i++)
+        {
+            fixed[i].first->setVal(fixed[i].second);
+            fixed[i].first->setConstant(1);
+        }
+        delete params;
+    }
+
+    template <class Minimizer>
+    int attempt(Minimizer& minim, const std::string& type, int strat, const FitOptions& options, FitRecord& record)
+    {
+        minim.setStrategy(strat);
+        record.nrAttempts++;
+        if (strat > record.strategy) record.strategy = strat;
+        record.minimizer = type;
+        return minim.minimize(type.c_str(), options.algorithm.c_str());
+    }
+
+    static std::string escape(const std::string& s)
+    {
+        std::string out;
+        for (unsigned int i=0;i<s.size();i++)
+        {
+            if (s[i] == '"' || s[i] == '\\') out += '\\';
+            out += s[i];
+        }
+        return out;
+    }
+
+    // JSON has no nan/inf
+    static std::string number(double x)
+    {
+        std::stringstream out;
+        out << std::setprecision(17);
+        if (x != x || x > 1e300 || x < -1e300) out << "null";
+        else out << x;
+        return out.str();
+    }
+
+    FitOptions opts;
+    RooWorkspace* w;
+    std::vector<FitRecord> fits;
+};
+
+#endif
@@ -0,0 +1,1286 @@
+/*
+Description: Flattened binned likelihood for HistFactory models, used by runSig.C and AsymptoticsCLs.C.
+
+FlatBinnedModel walks the pdf of a ModelConfig (RooSimultaneous -> RooProdPdf -> RooRealSumPdf) once
+and copies it into contiguous buffers: one constant yield per sample and bin, the scalar norm
+factors, the per-bin ParamHistFunc parameters and, for every PiecewiseInterpolation and
+FlexibleInterpVar, the nominal/low/high values and interpolation coefficients of each parameter.
+The interpolation codes are not read from the objects, they are identified by probing every term
+at a few parameter values, so the extraction does not depend on the HistFactory class internals.
+The Gaussian and Poisson constraint terms are probed the same way. Anything the extraction does
+not recognise makes the model invalid, and the callers fall back to the usual RooNLLVar.
+
+FlatBinnedNLL evaluates -log L = sum_bins (nu - n log nu) + constraints and its analytic gradient
+with plain loops over the bins of each sample. It is offset to the value of the RooNLLVar it is
+built from (the offset is recomputed whenever the global observables change), so minimized NLL
+values are interchangeable with the RooFit ones. FitEngine uses the gradient when it is available.
+
+createFlatNLL() checks every flat NLL against its RooNLLVar at a few random parameter points and
+its gradient against finite differences before handing it out.
+
+FlatBinnedModel::fillAsimov() fills the Asimov dataset of a channel from yields computed for all
+channels in one pass, with the same bin selection as the getVal() loop of makeAsimovData.
+*/
+
+#ifndef HHSTAT_FLATBINNEDNLL_H
+#define HHSTAT_FLATBINNEDNLL_H
+
+#include "TMath.h"
+#include "TRandom3.h"
+#include "TString.h"
+
+#include "RooAbsData.h"
+#include "RooAbsPdf.h"
+#include "RooAbsReal.h"
+#include "RooArgList.h"
+#include "RooArgSet.h"
+#include "RooCategory.h"
+#include "RooDataSet.h"
+#include "RooGlobalFunc.h"
+#include "RooListProxy.h"
+#include "RooProdPdf.h"
+#include "RooProduct.h"
+#include "RooRealSumPdf.h"
+#include "RooRealVar.h"
+#include "RooSimultaneous.h"
+#include "RooStats/ModelConfig.h"
+
+#include "FitEngine.h"
+
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <iostream>
+
+class FlatBinnedModel
+{
+    public:
+
+    // interpolation of one parameter, as in PiecewiseInterpolation and FlexibleInterpVar
+    enum { LINEAR = 0, EXPONENTIAL, QUADRATIC, POLYNOMIAL, POLYEXPONENTIAL, NKINDS };
+    enum { BINPARAM = 0, INTERPOLATION };
+    enum { GAUSSIAN = 0, POISSON };
+
+    FlatBinnedModel(RooStats::ModelConfig* _mc, const RooArgSet& _constrained, bool _verbose = false):
+        mc(_mc),
+        constrainedParams(_constrained),
+        verbose(_verbose),
+        isValid(false),
+        nbins(0),
+        catName(""),
+        interpCoefs(1, 0.)
+    {
+        isValid = extract();
+        if (!isValid) std::cout << "WARNING::Model can't be flattened, using RooNLLVar" << std::endl;
+        else if (verbose) print();
+    }
+
+    bool valid() const { return isValid; }
+    RooAbsPdf* pdf() const { return mc->GetPdf(); }
+    const RooArgSet& constrained() const { return constrainedParams; }
+    const std::vector<RooRealVar*>& parameters() const { return params; }
+    const std::vector<RooRealVar*>& globals() const { return globs; }
+    int nrBins() const { return nbins; }
+
+    int paramIndex(const RooAbsArg* arg) const
+    {
+        std::map<const RooAbsArg*, int>::const_iterator itr = paramIndices.find(arg);
+        return itr == paramIndices.end() ? -1 : itr->second;
+    }
+
+    // global bin of a data row, -1 if it belongs to no channel
+    int binOf(const RooArgSet& row) const
+    {
+        std::string label = catName.size() ? row.getCatLabel(catName.c_str()) : "";
+        std::map<std::string, int>::const_iterator itr = channelIndices.find(label);
+        if (itr == channelIndices.end()) return -1;
+        const Channel& ch = channels[itr->second];
+        double x = row.getRealValue(ch.obs->GetName());
+        if (x < ch.obs->getMin() || x > ch.obs->getMax()) return -1;
+        return ch.first + ch.obs->getBinning().binNumber(x);
+    }
+
+    // read the current parameter values
+    void readParameters(std::vector<double>& x) const
+    {
+        x.resize(params.size());
+        for (unsigned int i=0;i<params.size();i++) x[i] = params[i]->getVal();
+    }
+
+    // expected events of every bin at the current parameter values, recomputed only if they changed
+    const std::vector<double>& expected()
+    {
+        readParameters(xTmp);
+        if (xTmp != xYields || yields.size() != (unsigned int)nbins)
+        {
+            xYields = xTmp;
+            yields.resize(nbins);
+            evaluate(&xYields[0], &yields[0], false);
+        }
+        return yields;
+    }
+
+    // asimov data of one channel at the current parameter values, false if the channel is unknown
+    bool fillAsimov(const char* channel, RooDataSet* data, const RooArgSet& row)
+    {
+        std::map<std::string, int>::const_iterator itr = channelIndices.find(channel ? channel : "");
+        if (!isValid || itr == channelIndices.end()) return false;
+        const std::vector<double>& nu = expected();
+        const Channel& ch = channels[itr->second];
+        for (int jj=0;jj<ch.nbins;jj++)
+        {
+            ch.obs->setBin(jj);
+            double n = nu[ch.first+jj];
+            if (n > 0 && n < pow(10.0, 18)) data->add(row, n);
+        }
+        return true;
+    }
+
+    // per-bin expected events nu for the parameter values x; keeps what gradient() needs if asked
+    void evaluate(const double* x, double* nu, bool withGradient)
+    {
+        for (unsigned int f=0;f<factors.size();f++) evaluateFactor(factors[f], x, withGradient);
+        for (int b=0;b<nbins;b++) nu[b] = 0;
+        for (unsigned int s=0;s<samples.size();s++)
+        {
+            Sample& sample = samples[s];
+            const int nb = sample.nbins;
+            double scale = 1;
+            for (unsigned int k=0;k<sample.norms.size();k++) scale *= x[sample.norms[k]];
+            for (unsigned int k=0;k<sample.scalars.size();k++) scale *= factorValues[factors[sample.scalars[k]].value];
+            double* base = &sampleBase[sample.base];
+            const double* yield = &sampleYield[sample.yield];
+            for (int b=0;b<nb;b++) base[b] = yield[b];
+            for (unsigned int j=0;j<sample.binFactors.size();j++)
+            {
+                const double* value = &factorValues[factors[sample.binFactors[j]].value];
+                for (int b=0;b<nb;b++) base[b] *= value[b];
+            }
+            double* out = nu + sample.first;
+            for (int b=0;b<nb;b++) out[b] += scale*base[b];
+        }
+    }
+
+    // add d(sum_b w_b nu_b)/dx to grad, after evaluate(x, nu, true)
+    void gradient(const double* x, const double* w, double* grad)
+    {
+        for (unsigned int s=0;s<samples.size();s++)
+        {
+            Sample& sample = samples[s];
+            const int nb = sample.nbins;
+            const double* wb = w + sample.first;
+            const double* base = &sampleBase[sample.base];
+
+            // scalars: norm factors then scalar interpolations, excluded one at a time
+            const int nn = sample.norms.size();
+            const int ns = nn + sample.scalars.size();
+            scalarValues.resize(ns);
+            scalarSuffix.resize(ns+1);
+            for (int k=0;k<nn;k++) scalarValues[k] = x[sample.norms[k]];
+            for (int k=nn;k<ns;k++) scalarValues[k] = factorValues[factors[sample.scalars[k-nn]].value];
+            scalarSuffix[ns] = 1;
+            for (int k=ns-1;k>=0;k--) scalarSuffix[k] = scalarSuffix[k+1]*scalarValues[k];
+            const double scale = scalarSuffix[0];
+
+            double sum = 0;
+            for (int b=0;b<nb;b++) sum += wb[b]*base[b];
+            double prefix = 1;
+            for (int k=0;k<ns;k++)
+            {
+                double dk = sum*prefix*scalarSuffix[k+1];
+                if (k < nn) grad[sample.norms[k]] += dk;
+                else addTerms(factors[sample.scalars[k-nn]], &dk, 1, grad);
+                prefix *= scalarValues[k];
+            }
+
+            // per-bin factors, excluded one at a time with prefix/suffix products
+            const int nf = sample.binFactors.size();
+            if (!nf) continue;
+            binSuffix.resize((nf+1)*nb);
+            double* suffix = &binSuffix[0];
+            for (int b=0;b<nb;b++) suffix[nf*nb+b] = 1;
+            for (int j=nf-1;j>=0;j--)
+            {
+                const double* value = &factorValues[factors[sample.binFactors[j]].value];
+                double* cur = suffix + j*nb;
+                const double* next = cur + nb;
+                for (int b=0;b<nb;b++) cur[b] = next[b]*value[b];
+            }
+            binPrefix.resize(nb);
+            binDeriv.resize(nb);
+            double* pre = &binPrefix[0];
+            double* der = &binDeriv[0];
+            const double* yield = &sampleYield[sample.yield];
+            for (int b=0;b<nb;b++) pre[b] = scale*wb[b]*yield[b];
+            for (int j=0;j<nf;j++)
+            {
+                const Factor& factor = factors[sample.binFactors[j]];
+                const double* next = suffix + (j+1)*nb;
+                for (int b=0;b<nb;b++) der[b] = pre[b]*next[b];
+                if (factor.type == BINPARAM)
+                {
+                    const int* index = &binParams[factor.params];
+                    const double* coef = &binCoefs[factor.params];
+                    for (int b=0;b<nb;b++) if (index[b] >= 0) grad[index[b]] += der[b]*coef[b];
+                }
+                else addTerms(factor, der, nb, grad);
+                const double* value = &factorValues[factor.value];
+                for (int b=0;b<nb;b++) pre[b] *= value[b];
+            }
+        }
+    }
+
+    // constraint terms -log C up to a constant, and their gradient if grad is not NULL
+    double constraints(const double* x, double* grad) const
+    {
+        double sum = 0;
+        for (unsigned int i=0;i<constraintTerms.size();i++)
+        {
+            const Constraint& c = constraintTerms[i];
+            double center = c.glob >= 0 ? globs[c.glob]->getVal() : c.center;
+            double t = x[c.param];
+            if (c.type == GAUSSIAN)
+            {
+                double d = t - center;
+                sum += 0.5*c.scale*d*d;
+                if (grad) grad[c.param] += c.scale*d;
+            }
+            else
+            {
+                sum += c.scale*t - center*log(t);
+                if (grad) grad[c.param] += c.scale - center/t;
+            }
+        }
+        return sum;
+    }
+
+    void print() const
+    {
+        int nrTerms = 0;
+        for (unsigned int f=0;f<factors.size();f++) nrTerms += factors[f].nrTerms;
+        std::cout << "Flattened model: " << channels.size() << " channels, " << samples.size() << " samples, "
+                  << nbins << " bins, " << params.size() << " parameters, " << factors.size() << " factors, "
+                  << nrTerms << " interpolation terms, " << constraintTerms.size() << " constraints" << std::endl;
+    }
+
+    private:
+
+    struct Channel
+    {
+        std::string label;
+        RooRealVar* obs;
+        int first;
+        int nbins;
+    };
+
+    struct Sample
+    {
+        std::string name;
+        int channel;
+        int first;                   // first global bin
+        int nbins;
+        int yield;                   // constant yield of each bin in sampleYield
+        int base;                    // scratch in sampleBase
+        std::vector<int> norms;      // parameters multiplying all bins
+        std::vector<int> scalars;    // factors with a single value
+        std::vector<int> binFactors; // factors with one value per bin
+    };
+
+    struct Factor
+    {
+        int type;
+        int nbins;
+        int value;     // factor value of each bin in factorValues
+        double floor;  // values <= floor are replaced by floor
+        int params;    // BINPARAM: parameter and coefficient of each bin in binParams/binCoefs
+        int nominal;   // INTERPOLATION: nominal of each bin in interpNominal
+        int firstTerm;
+        int nrTerms;
+    };
+
+    struct Term
+    {
+        int param;
+        int kind;
+        bool multiplicative;
+        int low;       // low and high of each bin in interpLow/interpHigh
+        int high;
+        int coef;      // kind dependent coefficients in interpCoefs, ncoefs(kind) rows of nbins
+        int scratch;   // value, derivative and running product of each bin in termValue/termDeriv/termPrev
+    };
+
+    struct Constraint
+    {
+        int type;
+        int param;
+        int glob;      // global observable used as center (gaussian) or count (poisson), -1 if constant
+        double center;
+        double scale;  // inverse variance (gaussian) or tau (poisson)
+    };
+
+    static int ncoefs(int kind)
+    {
+        switch (kind)
+        {
+            case EXPONENTIAL: return 2;
+            case QUADRATIC: return 2;
+            case POLYNOMIAL: return 2;
+            case POLYEXPONENTIAL: return 8;
+            default: return 0;
+        }
+    }
+
+    static bool isMultiplicative(int kind)
+    {
+        return kind == EXPONENTIAL || kind == POLYEXPONENTIAL;
+    }
+
+    // coefficients of one term from its nominal, low and high values
+    static void coefficients(int kind, int nb, const double* nom, const double* lo, const double* hi, double* coef)
+    {
+        for (int b=0;b<nb;b++)
+        {
+            double n = nom[b], l = lo[b], h = hi[b];
+            if (kind == EXPONENTIAL)
+            {
+                coef[b] = log(h/n);
+                coef[nb+b] = log(l/n);
+            }
+            else if (kind == QUADRATIC)
+            {
+                coef[b] = 0.5*(h+l)-n;
+                coef[nb+b] = 0.5*(h-l);
+            }
+            else if (kind == POLYNOMIAL)
+            {
+                coef[b] = 0.5*(h-l);
+                coef[nb+b] = 0.0625*(h+l-2*n);
+            }
+            else if (kind == POLYEXPONENTIAL)
+            {
+                // 6th order polynomial matching value, slope and curvature of the exponentials at +-1
+                double up = h/n, down = l/n;
+                double logHi = log(up), logLo = log(down);
+                double upLog = up <= 0 ? 0 : up*logHi;
+                double downLog = down <= 0 ? 0 : -down*logLo;
+                double upLog2 = up <= 0 ? 0 : upLog*logHi;
+                double downLog2 = down <= 0 ? 0 : -downLog*logLo;
+                double S0 = 0.5*(up+down), A0 = 0.5*(up-down);
+                double S1 = 0.5*(upLog+downLog), A1 = 0.5*(upLog-downLog);
+                double S2 = 0.5*(upLog2+downLog2), A2 = 0.5*(upLog2-downLog2);
+                coef[b] = logHi;
+                coef[nb+b] = logLo;
+                coef[2*nb+b] = (15*A0 - 7*S1 + A2)/8.;
+                coef[3*nb+b] = (-24 + 24*S0 - 9*A1 + S2)/8.;
+                coef[4*nb+b] = (-5*A0 + 5*S1 - A2)/4.;
+                coef[5*nb+b] = (12 - 12*S0 + 7*A1 - S2)/4.;
+                coef[6*nb+b] = (3*A0 - 3*S1 + A2)/8.;
+                coef[7*nb+b] = (-8 + 8*S0 - 5*A1 + S2)/8.;
+            }
+        }
+    }
+
+    // change (additive kinds) or ratio (multiplicative kinds) of one term at a, and its derivative
+    static void interpolate(int kind, double a, int nb, const double* nom, const double* lo, const double* hi,
+                            const double* coef, double* v, double* d)
+    {
+        if (kind == LINEAR)
+        {
+            if (a > 0) for (int b=0;b<nb;b++) { d[b] = hi[b]-nom[b]; v[b] = a*d[b]; }
+            else       for (int b=0;b<nb;b++) { d[b] = nom[b]-lo[b]; v[b] = a*d[b]; }
+        }
+        else if (kind == EXPONENTIAL)
+        {
+            if (a >= 0) for (int b=0;b<nb;b++) { v[b] = exp(a*coef[b]); d[b] = v[b]*coef[b]; }
+            else        for (int b=0;b<nb;b++) { v[b] = exp(-a*coef[nb+b]); d[b] = -v[b]*coef[nb+b]; }
+        }
+        else if (kind == QUADRATIC)
+        {
+            const double* qa = coef;
+            const double* qb = coef + nb;
+            if (a > 1)       for (int b=0;b<nb;b++) { d[b] = 2*qa[b]+qb[b]; v[b] = d[b]*(a-1)+hi[b]-nom[b]; }
+            else if (a < -1) for (int b=0;b<nb;b++) { d[b] = -(2*qa[b]-qb[b]); v[b] = d[b]*(a+1)+lo[b]-nom[b]; }
+            else             for (int b=0;b<nb;b++) { v[b] = qa[b]*a*a+qb[b]*a; d[b] = 2*qa[b]*a+qb[b]; }
+        }
+        else if (kind == POLYNOMIAL)
+        {
+            const double* S = coef;
+            const double* A = coef + nb;
+            if (a > 1)       for (int b=0;b<nb;b++) { d[b] = hi[b]-nom[b]; v[b] = a*d[b]; }
+            else if (a < -1) for (int b=0;b<nb;b++) { d[b] = nom[b]-lo[b]; v[b] = a*d[b]; }
+            else
+            {
+                const double a2 = a*a;
+                const double p = a2*(15 + a2*(-10 + 3*a2));
+                const double dp = a*(30 + a2*(-40 + 18*a2));
+                for (int b=0;b<nb;b++)
+                {
+                    double change = a*S[b] + A[b]*p;
+                    bool clip = nom[b] + change < 0;
+                    v[b] = clip ? -nom[b] : change;
+                    d[b] = clip ? 0 : S[b] + A[b]*dp;
+                }
+            }
+        }
+        else if (kind == POLYEXPONENTIAL)
+        {
+            if (a >= 1)      for (int b=0;b<nb;b++) { v[b] = exp(a*coef[b]); d[b] = v[b]*coef[b]; }
+            else if (a < -1) for (int b=0;b<nb;b++) { v[b] = exp(-a*coef[nb+b]); d[b] = -v[b]*coef[nb+b]; }
+            else
+            {
+                const double* c = coef + 2*nb;
+                for (int b=0;b<nb;b++)
+                {
+                    double c1 = c[b], c2 = c[nb+b], c3 = c[2*nb+b], c4 = c[3*nb+b], c5 = c[4*nb+b], c6 = c[5*nb+b];
+                    v[b] = 1 + a*(c1 + a*(c2 + a*(c3 + a*(c4 + a*(c5 + a*c6)))));
+                    d[b] = c1 + a*(2*c2 + a*(3*c3 + a*(4*c4 + a*(5*c5 + a*6*c6))));
+                }
+            }
+        }
+    }
+
+    void evaluateFactor(Factor& factor, const double* x, bool withGradient)
+    {
+        const int nb = factor.nbins;
+        double* value = &factorValues[factor.value];
+        if (factor.type == BINPARAM)
+        {
+            const int* index = &binParams[factor.params];
+            const double* coef = &binCoefs[factor.params];
+            for (int b=0;b<nb;b++) value[b] = index[b] >= 0 ? coef[b]*x[index[b]] : coef[b];
+            return;
+        }
+
+        // forward pass: running value after each term
+        const double* nom = &interpNominal[factor.nominal];
+        for (int b=0;b<nb;b++) value[b] = nom[b];
+        for (int t=factor.firstTerm;t<factor.firstTerm+factor.nrTerms;t++)
+        {
+            const Term& term = terms[t];
+            double* v = &termValue[term.scratch];
+            double* d = &termDeriv[term.scratch];
+            double* prev = &termPrev[term.scratch];
+            interpolate(term.kind, x[term.param], nb, nom, &interpLow[term.low], &interpHigh[term.high],
+                        &interpCoefs[0] + term.coef, v, d);
+            for (int b=0;b<nb;b++) prev[b] = value[b];
+            if (term.multiplicative) for (int b=0;b<nb;b++) value[b] *= v[b];
+            else                     for (int b=0;b<nb;b++) value[b] += v[b];
+        }
+        if (!withGradient)
+        {
+            for (int b=0;b<nb;b++) if (value[b] <= factor.floor) value[b] = factor.floor;
+            return;
+        }
+
+        // backward pass: d value / d term, turned into d value / d parameter in termDeriv
+        factorMult.assign(nb, 1.);
+        double* mult = &factorMult[0];
+        for (int b=0;b<nb;b++) if (value[b] <= factor.floor) { value[b] = factor.floor; mult[b] = 0; }
+        for (int t=factor.firstTerm+factor.nrTerms-1;t>=factor.firstTerm;t--)
+        {
+            const Term& term = terms[t];
+            const double* v = &termValue[term.scratch];
+            double* d = &termDeriv[term.scratch];
+            const double* prev = &termPrev[term.scratch];
+            if (term.multiplicative)
+            {
+                for (int b=0;b<nb;b++) { d[b] *= prev[b]*mult[b]; mult[b] *= v[b]; }
+            }
+            else for (int b=0;b<nb;b++) d[b] *= mult[b];
+        }
+    }
+
+    // grad[param of term] += sum_b der_b d factor_b / d param
+    void addTerms(const Factor& factor, const double* der, int nb, double* grad) const
+    {
+        for (int t=factor.firstTerm;t<factor.firstTerm+factor.nrTerms;t++)
+        {
+            const double* d = &termDeriv[terms[t].scratch];
+            double sum = 0;
+            for (int b=0;b<nb;b++) sum += der[b]*d[b];
+            grad[terms[t].param] += sum;
+        }
+    }
+
+    ////////////////
+    // extraction //
+    ////////////////
+
+    bool fail(const std::string& why) const
+    {
+        std::cout << "WARNING::FlatBinnedModel: " << why << std::endl;
+        return false;
+    }
+
+    static bool close(double a, double b, double tol = 1e-7)
+    {
+        return fabs(a-b) <= tol*(fabs(a)+fabs(b)) + 1e-12;
+    }
+
+    // set a parameter and return the value it actually took
+    static double setParam(RooRealVar* var, double val)
+    {
+        var->setVal(val);
+        return var->getVal();
+    }
+
+    bool extract()
+    {
+        RooAbsPdf* top = mc->GetPdf();
+        if (!top || !mc->GetObservables()) return fail("no pdf or observables");
+
+        // model parameters: nuisance parameters, POIs and any other floating parameter
+        RooArgSet globSet;
+        if (mc->GetGlobalObservables()) globSet.add(*mc->GetGlobalObservables());
+        RooArgSet candidates;
+        if (mc->GetNuisanceParameters()) candidates.add(*mc->GetNuisanceParameters());
+        if (mc->GetParametersOfInterest()) candidates.add(*mc->GetParametersOfInterest());
+        RooArgSet* pdfParams = top->getParameters(*mc->GetObservables());
+        TIterator* itr = pdfParams->createIterator();
+        RooAbsArg* arg;
+        while ((arg = (RooAbsArg*)itr->Next()))
+        {
+            if (!arg->isConstant()) candidates.add(*arg, true);
+        }
+        delete itr;
+        delete pdfParams;
+        itr = candidates.createIterator();
+        while ((arg = (RooAbsArg*)itr->Next()))
+        {
+            if (globSet.find(arg->GetName())) continue;
+            RooRealVar* var = dynamic_cast<RooRealVar*>(arg);
+            if (!var) { delete itr; return fail(std::string("parameter ") + arg->GetName() + " is not a RooRealVar"); }
+            paramIndices[var] = params.size();
+            params.push_back(var);
+            modelParams.add(*var);
+        }
+        delete itr;
+        itr = globSet.createIterator();
+        while ((arg = (RooAbsArg*)itr->Next()))
+        {
+            RooRealVar* var = dynamic_cast<RooRealVar*>(arg);
+            if (!var) { delete itr; return fail(std::string("global observable ") + arg->GetName() + " is not a RooRealVar"); }
+            globIndices[var] = globs.size();
+            globs.push_back(var);
+        }
+        delete itr;
+
+        // probing moves the parameters around, start every step from the original values
+        std::vector<double> saved;
+        readParameters(saved);
+        bool ok = extractChannels(top);
+        for (unsigned int i=0;i<params.size();i++) params[i]->setVal(saved[i]);
+        ok = ok && extractConstraints(top);
+        for (unsigned int i=0;i<params.size();i++) params[i]->setVal(saved[i]);
+        ok = ok && check();
+        for (unsigned int i=0;i<params.size();i++) params[i]->setVal(saved[i]);
+        return ok;
+    }
+
+    bool extractChannels(RooAbsPdf* top)
+    {
+        RooSimultaneous* sim = dynamic_cast<RooSimultaneous*>(top);
+        if (!sim) return extractChannel("", top);
+        RooCategory* cat = (RooCategory*)&sim->indexCat();
+        catName = cat->GetName();
+        int saved = cat->getIndex();
+        TIterator* itr = cat->typeIterator();
+        RooCatType* type;
+        std::vector<std::string> labels;
+        while ((type = (RooCatType*)itr->Next())) labels.push_back(type->GetName());
+        delete itr;
+        bool ok = true;
+        for (unsigned int i=0;ok && i<labels.size();i++)
+        {
+            RooAbsPdf* pdf = sim->getPdf(labels[i].c_str());
+            if (pdf) ok = extractChannel(labels[i], pdf);
+        }
+        cat->setIndex(saved);
+        return ok;
+    }
+
+    // the observable dependent term of a channel pdf
+    RooRealSumPdf* findSum(RooAbsPdf* pdf)
+    {
+        RooRealSumPdf* sum = dynamic_cast<RooRealSumPdf*>(pdf);
+        if (sum) return sum;
+        RooProdPdf* prod = dynamic_cast<RooProdPdf*>(pdf);
+        if (!prod) return NULL;
+        TIterator* itr = prod->pdfList().createIterator();
+        RooAbsArg* arg;
+        while ((arg = (RooAbsArg*)itr->Next()))
+        {
+            if (!arg->dependsOn(*mc->GetObservables())) continue;
+            if (sum) { sum = NULL; break; }
+            sum = findSum((RooAbsPdf*)arg);
+            if (!sum) break;
+        }
+        delete itr;
+        return sum;
+    }
+
+    bool extractChannel(const std::string& label, RooAbsPdf* pdf)
+    {
+        RooRealSumPdf* sum = findSum(pdf);
+        if (!sum) return fail("channel " + label + " is not a RooRealSumPdf (times constraints)");
+        RooArgSet* obsSet = sum->getObservables(*mc->GetObservables());
+        RooRealVar* obs = obsSet->getSize() == 1 ? dynamic_cast<RooRealVar*>(obsSet->first()) : NULL;
+        delete obsSet;
+        if (!obs) return fail("channel " + label + " doesn't have exactly one real observable");
+
+        Channel ch;
+        ch.label = label;
+        ch.obs = obs;
+        ch.first = nbins;
+        ch.nbins = obs->numBins();
+        channelIndices[label] = channels.size();
+        channels.push_back(ch);
+        nbins += ch.nbins;
+
+        const RooArgList& funcs = sum->funcList();
+        const RooArgList& coefs = sum->coefList();
+        if (funcs.getSize() != coefs.getSize()) return fail("channel " + label + " has fractions instead of coefficients");
+        double saved = obs->getVal();
+        bool ok = true;
+        for (int i=0;ok && i<funcs.getSize();i++)
+        {
+            Sample sample;
+            sample.name = funcs.at(i)->GetName();
+            sample.channel = channels.size()-1;
+            sample.first = ch.first;
+            sample.nbins = ch.nbins;
+            sample.yield = sampleYield.size();
+            sample.base = sampleBase.size();
+            for (int b=0;b<ch.nbins;b++) sampleYield.push_back(obs->getBinWidth(b));
+            sampleBase.resize(sampleBase.size()+ch.nbins);
+            ok = addFactor((RooAbsReal*)coefs.at(i), sample, obs) && addFactor((RooAbsReal*)funcs.at(i), sample, obs);
+            samples.push_back(sample);
+        }
+        obs->setVal(saved);
+        return ok;
+    }
+
+    void binValues(RooAbsReal* func, RooRealVar* obs, int nb, std::vector<double>& values)
+    {
+        values.resize(nb);
+        for (int b=0;b<nb;b++)
+        {
+            if (nb > 1 || func->dependsOn(*obs)) obs->setBin(b);
+            values[b] = func->getVal();
+        }
+    }
+
+    bool addFactor(RooAbsReal* func, Sample& sample, RooRealVar* obs)
+    {
+        const int nb = sample.nbins;
+        if (!func->dependsOn(modelParams))
+        {
+            std::vector<double> values;
+            binValues(func, obs, nb, values);
+            for (int b=0;b<nb;b++) sampleYield[sample.yield+b] *= values[b];
+            return true;
+        }
+        int index = paramIndex(func);
+        if (index >= 0)
+        {
+            sample.norms.push_back(index);
+            return true;
+        }
+        RooProduct* prod = dynamic_cast<RooProduct*>(func);
+        if (prod)
+        {
+            RooArgList components = prod->components();
+            for (int i=0;i<components.getSize();i++)
+            {
+                RooAbsReal* comp = dynamic_cast<RooAbsReal*>(components.at(i));
+                if (!comp) return fail(std::string("product ") + func->GetName() + " has a non real component");
+                if (!addFactor(comp, sample, obs)) return false;
+            }
+            return true;
+        }
+
+        std::map<const RooAbsArg*, int>::iterator cached = factorIndices.find(func);
+        int f = -1;
+        if (cached != factorIndices.end()) f = cached->second;
+        else
+        {
+            bool perBin = func->dependsOn(*obs);
+            if (func->InheritsFrom("ParamHistFunc")) f = addBinParams(func, obs, nb);
+            else f = addInterpolation(func, obs, perBin ? nb : 1);
+            if (f < 0) return false;
+            factorIndices[func] = f;
+        }
+        if (factors[f].nbins == 1 && nb > 1) sample.scalars.push_back(f);
+        else sample.binFactors.push_back(f);
+        return true;
+    }
+
+    std::vector<RooRealVar*> dependents(RooAbsReal* func)
+    {
+        std::vector<RooRealVar*> deps;
+        RooArgSet* vars = func->getVariables();
+        TIterator* itr = vars->createIterator();
+        RooAbsArg* arg;
+        while ((arg = (RooAbsArg*)itr->Next()))
+        {
+            int index = paramIndex(arg);
+            if (index >= 0) deps.push_back(params[index]);
+        }
+        delete itr;
+        delete vars;
+        return deps;
+    }
+
+    Factor newFactor(int type, int nb)
+    {
+        Factor factor;
+        factor.type = type;
+        factor.nbins = nb;
+        factor.value = factorValues.size();
+        factorValues.resize(factorValues.size()+nb);
+        factor.floor = -1e300;
+        factor.params = -1;
+        factor.nominal = -1;
+        factor.firstTerm = terms.size();
+        factor.nrTerms = 0;
+        return factor;
+    }
+
+    // ParamHistFunc: each bin is a coefficient times at most one parameter
+    int addBinParams(RooAbsReal* func, RooRealVar* obs, int nb)
+    {
+        std::vector<RooRealVar*> deps = dependents(func);
+        Factor factor = newFactor(BINPARAM, nb);
+        factor.params = binParams.size();
+        binParams.resize(binParams.size()+nb, -1);
+        binCoefs.resize(binCoefs.size()+nb, 0);
+
+        std::vector<double> one(deps.size()), base, probe;
+        for (unsigned int i=0;i<deps.size();i++) one[i] = setParam(deps[i], 1.);
+        binValues(func, obs, nb, base);
+        for (int b=0;b<nb;b++) binCoefs[factor.params+b] = base[b];
+        for (unsigned int i=0;i<deps.size();i++)
+        {
+            double two = setParam(deps[i], 2.);
+            if (one[i] == 0 || two == one[i])
+            {
+                fail(std::string("can't probe ") + deps[i]->GetName());
+                return -1;
+            }
+            binValues(func, obs, nb, probe);
+            for (int b=0;b<nb;b++)
+            {
+                if (close(probe[b], base[b])) continue;
+                int& index = binParams[factor.params+b];
+                if (index >= 0 || !close(probe[b]*one[i], base[b]*two))
+                {
+                    fail(std::string(func->GetName()) + " is not linear in one parameter per bin");
+                    return -1;
+                }
+                index = paramIndex(deps[i]);
+                binCoefs[factor.params+b] = base[b]/one[i];
+            }
+            deps[i]->setVal(one[i]);
+        }
+        factors.push_back(factor);
+        return factors.size()-1;
+    }
+
+    // PiecewiseInterpolation, FlexibleInterpVar or anything behaving like them
+    int addInterpolation(RooAbsReal* func, RooRealVar* obs, int nb)
+    {
+        std::vector<RooRealVar*> deps = dependents(func);
+        Factor factor = newFactor(INTERPOLATION, nb);
+        factor.floor = func->InheritsFrom("FlexibleInterpVar") ? 1e-9 : 0.;
+        for (unsigned int i=0;i<deps.size();i++)
+        {
+            if (setParam(deps[i], 0.) != 0)
+            {
+                fail(std::string("can't set ") + deps[i]->GetName() + " to zero");
+                return -1;
+            }
+        }
+        std::vector<double> nom, lo, hi, probe, coef;
+        binValues(func, obs, nb, nom);
+        factor.nominal = interpNominal.size();
+        interpNominal.insert(interpNominal.end(), nom.begin(), nom.end());
+
+        const double points[4] = {-1.6, -0.55, 0.35, 1.45};
+        std::vector<double> v(nb), d(nb);
+        for (unsigned int i=0;i<deps.size();i++)
+        {
+            RooRealVar* var = deps[i];
+            if (setParam(var, 1.) != 1.)
+            {
+                fail(std::string("can't set ") + var->GetName() + " to 1");
+                return -1;
+            }
+            binValues(func, obs, nb, hi);
+            if (setParam(var, -1.) != -1.)
+            {
+                fail(std::string("can't set ") + var->GetName() + " to -1");
+                return -1;
+            }
+            binValues(func, obs, nb, lo);
+            bool constant = true;
+            for (int b=0;b<nb;b++) if (!close(lo[b], nom[b], 1e-12) || !close(hi[b], nom[b], 1e-12)) constant = false;
+            if (constant) { var->setVal(0); continue; }
+
+            // identify the interpolation from its values between and beyond +-1
+            std::vector<std::vector<double> > probes;
+            std::vector<double> at;
+            for (int p=0;p<4;p++)
+            {
+                if (setParam(var, points[p]) != points[p]) continue;
+                binValues(func, obs, nb, probe);
+                probes.push_back(probe);
+                at.push_back(points[p]);
+            }
+            var->setVal(0);
+            int kind = -1;
+            for (int k=0;kind<0 && k<NKINDS;k++)
+            {
+                coef.assign(ncoefs(k)*nb+1, 0.);
+                coefficients(k, nb, &nom[0], &lo[0], &hi[0], &coef[0]);
+                bool match = true;
+                for (unsigned int p=0;match && p<probes.size();p++)
+                {
+                    interpolate(k, at[p], nb, &nom[0], &lo[0], &hi[0], &coef[0], &v[0], &d[0]);
+                    for (int b=0;match && b<nb;b++)
+                    {
+                        double pred = isMultiplicative(k) ? nom[b]*v[b] : nom[b]+v[b];
+                        if (pred <= factor.floor) pred = factor.floor;
+                        if (!close(pred, probes[p][b])) match = false;
+                    }
+                }
+                if (match) kind = k;
+            }
+            if (kind < 0)
+            {
+                fail(std::string("unknown interpolation of ") + var->GetName() + " in " + func->GetName());
+                return -1;
+            }
+
+            Term term;
+            term.param = paramIndex(var);
+            term.kind = kind;
+            term.multiplicative = isMultiplicative(kind);
+            term.low = interpLow.size();
+            interpLow.insert(interpLow.end(), lo.begin(), lo.end());
+            term.high = interpHigh.size();
+            interpHigh.insert(interpHigh.end(), hi.begin(), hi.end());
+            term.coef = interpCoefs.size();
+            coefficients(kind, nb, &nom[0], &lo[0], &hi[0], &coef[0]);
+            interpCoefs.insert(interpCoefs.end(), coef.begin(), coef.begin() + ncoefs(kind)*nb);
+            term.scratch = termValue.size();
+            termValue.resize(termValue.size()+nb);
+            termDeriv.resize(termDeriv.size()+nb);
+            termPrev.resize(termPrev.size()+nb);
+            terms.push_back(term);
+            factor.nrTerms++;
+        }
+        factors.push_back(factor);
+        return factors.size()-1;
+    }
+
+    void unfold(RooAbsArg* arg, std::vector<RooAbsPdf*>& out, std::set<RooAbsArg*>& seen)
+    {
+        if (seen.count(arg)) return;
+        seen.insert(arg);
+        RooProdPdf* prod = dynamic_cast<RooProdPdf*>(arg);
+        if (!prod)
+        {
+            out.push_back((RooAbsPdf*)arg);
+            return;
+        }
+        TIterator* itr = prod->pdfList().createIterator();
+        RooAbsArg* comp;
+        while ((comp = (RooAbsArg*)itr->Next())) unfold(comp, out, seen);
+        delete itr;
+    }
+
+    double constraintNLL(RooAbsPdf* pdf, RooRealVar* var, double t)
+    {
+        var->setVal(t);
+        return -log(pdf->getVal());
+    }
+
+    // -log C(t) is either k/2 (t - center)^2 or tau t - n log t, up to a constant
+    bool extractConstraints(RooAbsPdf* top)
+    {
+        if (!constrainedParams.getSize()) return true;
+        RooArgSet constrained(constrainedParams);
+        RooArgSet* all = top->getAllConstraints(*mc->GetObservables(), constrained);
+        std::vector<RooAbsPdf*> pdfs;
+        std::set<RooAbsArg*> seen;
+        TIterator* itr = all->createIterator();
+        RooAbsArg* arg;
+        while ((arg = (RooAbsArg*)itr->Next())) unfold(arg, pdfs, seen);
+        delete itr;
+        delete all;
+
+        for (unsigned int i=0;i<pdfs.size();i++)
+        {
+            RooAbsPdf* pdf = pdfs[i];
+            std::vector<RooRealVar*> deps = dependents(pdf);
+            if (deps.empty()) continue;
+            if (deps.size() > 1) return fail(std::string("constraint ") + pdf->GetName() + " depends on several parameters");
+            RooRealVar* var = deps[0];
+            int glob = -1;
+            RooArgSet* vars = pdf->getVariables();
+            itr = vars->createIterator();
+            while ((arg = (RooAbsArg*)itr->Next()))
+            {
+                std::map<const RooAbsArg*, int>::const_iterator g = globIndices.find(arg);
+                if (g == globIndices.end()) continue;
+                if (glob >= 0) { glob = -2; break; }
+                glob = g->second;
+            }
+            delete itr;
+            delete vars;
+            if (glob == -2) return fail(std::string("constraint ") + pdf->GetName() + " has several global observables");
+
+            // curvature at t0 and one width away tells the two shapes apart
+            double t0 = var->getVal();
+            double width = var->getError() > 0 ? var->getError() : 0.1;
+            double s = 0.1*width;
+            double f0 = constraintNLL(pdf, var, t0);
+            double curv0 = (constraintNLL(pdf, var, t0+s) - 2*f0 + constraintNLL(pdf, var, t0-s))/(s*s);
+            if (!(curv0 > 0)) return fail(std::string("constraint ") + pdf->GetName() + " is not convex");
+            width = 1./sqrt(curv0);
+            s = 0.1*width;
+            double t1 = t0 + width;
+            if (t1 + s > var->getMax()) t1 = t0 - width;
+            f0 = constraintNLL(pdf, var, t0);
+            double fp = constraintNLL(pdf, var, t0+s), fm = constraintNLL(pdf, var, t0-s);
+            curv0 = (fp - 2*f0 + fm)/(s*s);
+            double slope0 = (fp - fm)/(2*s);
+            double f1 = constraintNLL(pdf, var, t1);
+            double curv1 = (constraintNLL(pdf, var, t1+s) - 2*f1 + constraintNLL(pdf, var, t1-s))/(s*s);
+            var->setVal(t0);
+
+            Constraint c;
+            c.param = paramIndex(var);
+            c.glob = glob;
+            if (close(curv0, curv1, 1e-5))
+            {
+                c.type = GAUSSIAN;
+                c.center = t0 - slope0/curv0;
+                c.scale = curv0;
+                if (glob >= 0)
+                {
+                    double g = globs[glob]->getVal();
+                    if (!close(c.center, g, 1e-5) && fabs(c.center-g) > 1e-6*width)
+                        return fail(std::string("gaussian constraint ") + pdf->GetName() + " is not centered on its global observable");
+                    double denom = (t1-g)*(t1-g) - (t0-g)*(t0-g);
+                    if (fabs(denom) > 1e-3*width*width) c.scale = 2*(f1-f0)/denom;
+                }
+            }
+            else
+            {
+                c.type = POISSON;
+                c.center = curv0*t0*t0;
+                c.scale = slope0 + c.center/t0;
+                if (!(t0 > 0) || !close(c.center/(t1*t1), curv1, 1e-3))
+                    return fail(std::string("constraint ") + pdf->GetName() + " is neither gaussian nor poisson");
+                if (glob >= 0)
+                {
+                    double n = globs[glob]->getVal();
+                    if (!close(c.center, n, 1e-4))
+                        return fail(std::string("poisson constraint ") + pdf->GetName() + " doesn't count its global observable");
+                    c.center = n;
+                    c.scale = (f1 - f0 + n*log(t1/t0))/(t1-t0);
+                }
+            }
+            constraintTerms.push_back(c);
+        }
+        return true;
+    }
+
+    // the flattened yields must match the pdf at the current point and at a random one
+    bool check()
+    {
+        TRandom3 rnd(4357);
+        std::vector<double> x, nu(nbins), saved;
+        readParameters(saved);
+        for (int pass=0;pass<2;pass++)
+        {
+            if (pass)
+            {
+                for (unsigned int i=0;i<params.size();i++)
+                {
+                    double width = params[i]->getError() > 0 ? params[i]->getError() : 0.1;
+                    params[i]->setVal(saved[i] + 0.5*width*rnd.Uniform(-1, 1));
+                }
+            }
+            readParameters(x);
+            evaluate(&x[0], &nu[0], false);
+            for (unsigned int c=0;c<channels.size();c++)
+            {
+                const Channel& ch = channels[c];
+                RooAbsPdf* pdf = mc->GetPdf();
+                RooSimultaneous* sim = dynamic_cast<RooSimultaneous*>(pdf);
+                if (sim) pdf = sim->getPdf(ch.label.c_str());
+                RooArgSet* obstmp = pdf->getObservables(*mc->GetObservables());
+                double expectedEvents = pdf->expectedEvents(*obstmp);
+                for (int b=0;b<ch.nbins;b++)
+                {
+                    ch.obs->setBin(b);
+                    double ref = pdf->getVal(obstmp)*ch.obs->getBinWidth(b)*expectedEvents;
+                    if (!close(ref, nu[ch.first+b], 1e-6))
+                    {
+                        delete obstmp;
+                        std::stringstream why;
+                        why << "channel " << ch.label << " bin " << b << ": " << nu[ch.first+b] << " events instead of " << ref;
+                        return fail(why.str());
+                    }
+                }
+                delete obstmp;
+            }
+        }
+        for (unsigned int i=0;i<params.size();i++) params[i]->setVal(saved[i]);
+        return true;
+    }
+
+    RooStats::ModelConfig* mc;
+    RooArgSet constrainedParams;
+    bool verbose;
+    bool isValid;
+
+    std::vector<RooRealVar*> params;
+    std::vector<RooRealVar*> globs;
+    RooArgSet modelParams;
+    std::map<const RooAbsArg*, int> paramIndices;
+    std::map<const RooAbsArg*, int> globIndices;
+    std::map<const RooAbsArg*, int> factorIndices;
+
+    int nbins;
+    std::string catName;
+    std::vector<Channel> channels;
+    std::map<std::string, int> channelIndices;
+    std::vector<Sample> samples;
+    std::vector<Factor> factors;
+    std::vector<Term> terms;
+    std::vector<Constraint> constraintTerms;
+
+    // structure of arrays, see the offsets in Sample, Factor and Term
+    std::vector<double> sampleYield;
+    std::vector<double> sampleBase;
+    std::vector<double> factorValues;
+    std::vector<int> binParams;
+    std::vector<double> binCoefs;
+    std::vector<double> interpNominal;
+    std::vector<double> interpLow;
+    std::vector<double> interpHigh;
+    std::vector<double> interpCoefs;
+    std::vector<double> termValue;
+    std::vector<double> termDeriv;
+    std::vector<double> termPrev;
+
+    // scratch
+    std::vector<double> factorMult;
+    std::vector<double> scalarValues;
+    std::vector<double> scalarSuffix;
+    std::vector<double> binSuffix;
+    std::vector<double> binPrefix;
+    std::vector<double> binDeriv;
+    std::vector<double> xTmp;
+    std::vector<double> xYields;
+    std::vector<double> yields;
+};
+
+class FlatBinnedNLL : public RooAbsReal, public FitGradient
+{
+    public:
+
+    FlatBinnedNLL(const char* name, FlatBinnedModel* _model, const RooAbsData& data, RooAbsReal* _reference):
+        RooAbsReal(name, _reference->GetTitle()),
+        model(_model),
+        paramProxy("params", "parameters and global observables", this),
+        reference(_reference),
+        ownReference(true),
+        useGradient(true),
+        offset(0)
+    {
+        const std::vector<RooRealVar*>& params = model->parameters();
+        const std::vector<RooRealVar*>& globs = model->globals();
+        for (unsigned int i=0;i<params.size();i++) paramProxy.add(*params[i]);
+        for (unsigned int i=0;i<globs.size();i++) paramProxy.add(*globs[i]);
+        counts.assign(model->nrBins(), 0.);
+        for (int i=0;i<data.numEntries();i++)
+        {
+            const RooArgSet* row = data.get(i);
+            int bin = model->binOf(*row);
+            if (bin >= 0) counts[bin] += data.weight();
+        }
+    }
+
+    FlatBinnedNLL(const FlatBinnedNLL& other, const char* name = 0):
+        RooAbsReal(other, name),
+        model(other.model),
+        paramProxy("params", this, other.paramProxy),
+        counts(other.counts),
+        reference(other.reference),
+        ownReference(false),
+        useGradient(other.useGradient),
+        offset(other.offset),
+        globValues(other.globValues)
+        {}
+
+    virtual ~FlatBinnedNLL()
+    {
+        if (ownReference) delete reference;
+    }
+
+    virtual TObject* clone(const char* newname) const { return new FlatBinnedNLL(*this, newname); }
+    virtual Double_t defaultErrorLevel() const { return 0.5; }
+
+    RooAbsReal* getReference() const { return reference; }
+
+    // hand the RooNLLVar over to the caller, e.g. to fall back on it
+    RooAbsReal* releaseReference()
+    {
+        ownReference = false;
+        return reference;
+    }
+
+    bool hasGradient() const { return useGradient; }
+
+    void gradient(const std::vector<RooRealVar*>& vars, double* grad)
+    {
+        model->readParameters(x);
+        gradBuffer.assign(x.size(), 0.);
+        raw(true);
+        model->gradient(&x[0], &w[0], &gradBuffer[0]);
+        model->constraints(&x[0], &gradBuffer[0]);
+        for (unsigned int i=0;i<vars.size();i++)
+        {
+            int index = model->paramIndex(vars[i]);
+            grad[i] = index >= 0 ? gradBuffer[index] : 0;
+        }
+    }
+
+    // compare with the RooNLLVar at random points, and the gradient with finite differences
+    bool validate(bool verbose = false)
+    {
+        const std::vector<RooRealVar*>& params = model->parameters();
+        std::vector<double> saved;
+        model->readParameters(saved);
+        TRandom3 rnd(4357);
+        double flat0 = getVal(), ref0 = reference->getVal();
+        bool ok = true;
+        for (int i=0;ok && i<5;i++)
+        {
+            for (unsigned int p=0;p<params.size();p++)
+            {
+                double width = params[p]->getError() > 0 ? params[p]->getError() : 0.1;
+                params[p]->setVal(saved[p] + 0.5*width*rnd.Uniform(-1, 1));
+            }
+            double dflat = getVal() - flat0, dref = reference->getVal() - ref0;
+            if (verbose) std::cout << "Flat NLL check: " << dflat << " vs " << dref << std::endl;
+            if (!(fabs(dflat-dref) <= 1e-6*(1+fabs(dref)))) ok = false;
+        }
+        if (!ok)
+        {
+            std::cout << "WARNING::Flat NLL doesn't match " << reference->GetName() << ", using RooNLLVar" << std::endl;
+            for (unsigned int p=0;p<params.size();p++) params[p]->setVal(saved[p]);
+            return false;
+        }
+
+        // params are still at the last random point
+        std::vector<double> grad(params.size());
+        gradient(params, &grad[0]);
+        for (unsigned int p=0;useGradient && p<params.size();p++)
+        {
+            RooRealVar* var = params[p];
+            double val = var->getVal();
+            double h = 1e-5*std::max(1., fabs(val));
+            double up = std::min(val+h, var->getMax()), down = std::max(val-h, var->getMin());
+            if (up <= down) continue;
+            var->setVal(up);
+            double fup = getVal();
+            var->setVal(down);
+            double fdown = getVal();
+            var->setVal(val);
+            double fd = (fup-fdown)/(up-down);
+            if (!(fabs(fd-grad[p]) <= 1e-3*(1+fabs(fd))))
+            {
+                std::cout << "WARNING::Flat NLL gradient of " << var->GetName() << " is " << grad[p]
+                          << " instead of " << fd << ", using numerical derivatives" << std::endl;
+                useGradient = false;
+            }
+        }
+        for (unsigned int p=0;p<params.size();p++) params[p]->setVal(saved[p]);
+        return true;
+    }
+
+    protected:
+
+    Double_t evaluate() const
+    {
+        model->readParameters(x);
+        double val = raw(false);
+        const std::vector<RooRealVar*>& globs = model->globals();
+        bool changed = globValues.size() != globs.size();
+        globValues.resize(globs.size());
+        for (unsigned int i=0;i<globs.size();i++)
+        {
+            if (globValues[i] != globs[i]->getVal()) changed = true;
+            globValues[i] = globs[i]->getVal();
+        }
+        if (changed) offset = reference->getVal() - val;
+        return val + offset;
+    }
+
+    private:
+
+    // sum_b (nu_b - n_b log nu_b) + constraints at x, keeps w_b = dNLL/dnu_b if withGradient
+    double raw(bool withGradient) const
+    {
+        const int nb = counts.size();
+        nu.resize(nb);
+        model->evaluate(&x[0], &nu[0], withGradient);
+        const double* n = &counts[0];
+        double sum = 0;
+        // bins without data only contribute nu (no 0*log(0) or 0/0 for empty templates)
+        for (int b=0;b<nb;b++) sum += nu[b] - (n[b] > 0 ? n[b]*log(nu[b]) : 0);
+        if (withGradient)
+        {
+            w.resize(nb);
+            for (int b=0;b<nb;b++) w[b] = n[b] > 0 ? 1 - n[b]/nu[b] : 1;
+        }
+        return sum + model->constraints(&x[0], NULL);
+    }
+
+    FlatBinnedModel* model;
+    RooListProxy paramProxy;
+    std::vector<double> counts;
+    RooAbsReal* reference;
+    bool ownReference;
+    bool useGradient;
+    mutable double offset;
+    mutable std::vector<double> globValues;
+    mutable std::vector<double> x;
+    mutable std::vector<double> nu;
+    mutable std::vector<double> w;
+    std::vector<double> gradBuffer;
+};
+
+// flat NLL of data if the model is valid and the check passes, the usual RooNLLVar otherwise
+inline RooAbsReal* createFlatNLL(FlatBinnedModel* model, RooAbsData& data, bool verbose = false)
+{
+    RooArgSet constrained(model->constrained());
+    RooAbsReal* reference = model->pdf()->createNLL(data, RooFit::Constrain(constrained));
+    if (!model->valid()) return reference;
+    FlatBinnedNLL* nll = new FlatBinnedNLL(reference->GetName(), model, data, reference);
+    if (nll->validate(verbose)) return nll;
+    nll->releaseReference();
+    delete nll;
+    return reference;
+}
+
+#endif
@@ -7,9 +7,25 @@ from rootpy.compiled import significance, make_asimov_data
 C.register_file(os.path.join(HERE, 'AsymptoticsCLs.C'),
                 ['AsymptoticsCLs'])
 from rootpy.compiled import AsymptoticsCLs
+C.register_file(os.path.join(HERE, 'NuisanceRanking.C'),
+                ['NuisanceRanking'])
+from rootpy.compiled import NuisanceRanking
+C.register_file(os.path.join(HERE, 'NuisanceScan.C'),
+                ['NuisanceScan'])
+from rootpy.compiled import NuisanceScan
+C.register_file(os.path.join(HERE, 'ToyMC.C'),
+                ['ToyMC'])
+from rootpy.compiled import ToyMC
+C.register_file(os.path.join(HERE, 'Benchmark.C'),
+                ['benchmark_minimize'])
+from rootpy.compiled import benchmark_minimize
 
 __all__ = [
     'AsymptoticsCLs',
+    'NuisanceRanking',
+    'NuisanceScan',
+    'ToyMC',
     'significance',
     'make_asimov_data',
+    'benchmark_minimize',
 ]
@@ -10,6 +10,7 @@ from rootpy.utils.lock import lock
 from rootpy.stats import Workspace
 
 # ---> local imports
+from .extern import NuisanceScan
 from .import log; log = log[__name__]
 
 class NuisParScan(Process):
@@ -75,6 +76,57 @@ def get_nuis_nll(ws, mc, nuispar_name, nuispar_val, ws_snapshot):
     return fitres.minNll()
 
 
+# ------------------------------------------------
+def nuisance_scan(ws, output,
+                  nuispars=None,
+                  n_jobs=1,
+                  low=-5., high=5., step=0.2,
+                  max_delta_nll=0.,
+                  refine_depth=3,
+                  verbose=False):
+    """
+    Scan the profile NLL of the given NPs (all floating NPs if None)
+    with the NuisanceScan macro and write all points to the ROOT file output.
+    The scans walk outward from the best fit with warm starts and refine
+    the grid where the profile is steep or not smooth.
+    - Parameters:
+    - ws: RooWorkspace
+    - output: name of the output ROOT file
+    - nuispars: list of NP names
+    - n_jobs: number of forked workers
+    - low, high, step: coarse grid
+    - max_delta_nll: stop walking once 2*dNLL exceeds this (0: full range)
+    - refine_depth: maximum number of grid refinements
+    """
+    scan = NuisanceScan(ws, verbose)
+    scan.setWorkers(n_jobs)
+    scan.setRange(low, high)
+    scan.setStep(step)
+    scan.setMaxTwiceDeltaNll(max_delta_nll)
+    scan.setRefinement(1., refine_depth)
+    n_points = scan.run(output, ','.join(nuispars or []))
+    if n_points < 0:
+        raise RuntimeError("scan failure")
+    return n_points
+
+
+# ------------------------------------------------
+def get_scans(file_name):
+    """
+    Read the output of nuisance_scan into the same dictionary as the
+    _nuispars_scan.pickle files: {'NOMINAL': nll_hat, np: [(val, nll), ...]}
+    """
+    scans = {}
+    with root_open(file_name) as file:
+        for entry in file.scan:
+            scans['NOMINAL'] = entry.nll_hat
+            scans.setdefault(str(entry.np), []).append((entry.val, entry.nll))
+    for np_name, values in scans.items():
+        if np_name != 'NOMINAL':
+            values.sort()
+    return scans
+
+
 # ------------------------------------------------
 def get_nuis_nll_nofit(ws, mc, nll_func, np_name, ws_snapshot):
     """
@@ -81,7 +81,10 @@ def parse_name(name):
 
 
 def get_data(pickle_file):
-    # read NP pull data from a pickle
+    # read NP pull data from a pickle or from a NuisanceRanking output file
+    if pickle_file.endswith('.root'):
+        from .pulls import get_ranking
+        return get_ranking(pickle_file)
     with open(pickle_file) as f:
         data = pickle.load(f)
     return data
@@ -11,6 +11,7 @@ from rootpy.stats import Workspace
 
 # local imports
 from nuisance import get_nuisance_params
+from .extern import NuisanceRanking
 from . import log; log = log[__name__]
 
 
@@ -63,6 +64,50 @@ class NuisancePullScan(Process):
                 pickle.dump(pulls, pickle_file)
 
 
+def nuisance_ranking(ws, output,
+                     poi_name='',
+                     n_jobs=1,
+                     linear_threshold=0,
+                     minos=False,
+                     verbose=False):
+    """
+    Rank all floating nuisance parameters of the workspace with the
+    NuisanceRanking macro and write the result into the ROOT file output.
+    The NLL is built once and the conditional fits are warm started from
+    the global fit. With linear_threshold > 0 the refits are skipped for
+    nuisance parameters with a linearized postfit impact below
+    linear_threshold * sigma(poi); a negative value skips all refits.
+    """
+    ranking = NuisanceRanking(ws, verbose)
+    ranking.setWorkers(n_jobs)
+    ranking.setLinearThreshold(linear_threshold)
+    ranking.setMinos(minos)
+    n_nps = ranking.run(output, poi_name)
+    if n_nps < 0:
+        raise RuntimeError("ranking failure")
+    return n_nps
+
+
+def get_ranking(file_name):
+    """
+    Read the output of nuisance_ranking into the same dictionary as the
+    _pulls.pickle files written by NuisancePullScan
+    """
+    pulls = {}
+    with root_open(file_name) as file:
+        for entry in file.ranking:
+            poi_hat = entry.poi_hat
+            pulls[str(entry.np)] = {
+                'poi_prefit': (entry.poi_prefit_down, poi_hat,
+                               entry.poi_prefit_up),
+                'poi_postfit': (entry.poi_postfit_down, poi_hat,
+                                entry.poi_postfit_up),
+                'np': (entry.np_val + entry.np_err_lo,
+                       entry.np_val,
+                       entry.np_val + entry.np_err_hi)}
+    return pulls
+
+
 def get_pull(ws, mc, poi_name, np_name, ws_snapshot):
     """
     TODO: Write a description
@@ -11,7 +11,14 @@ def significance(workspace,
                  injection=1.,
                  profile=False,
                  injection_test=False,
+                 verbose=False,
+                 fit_summary=None,
+                 flat_nll=False,
                  **fit_params):
+    # fit_summary: optional .json or .root file receiving the
+    # status, strategy, call count and timing of every fit
+    # flat_nll: fit the flattened binned likelihood (FlatBinnedNLL.h),
+    # falls back on RooNLLVar if the model can't be flattened
     floating_profile_mu = False
     profile_mu = 1.
     if isinstance(profile, basestring):
@@ -34,7 +41,9 @@ def significance(workspace,
     hist = _significance(workspace, observed,
                          injection, injection_test,
                          profile, profile_mu,
-                         floating_profile_mu)
+                         floating_profile_mu,
+                         'ModelConfig', 'obsData',
+                         verbose, fit_summary or '', flat_nll)
     # reset workspace
     workspace.loadSnapshot('nominal_globs')
     workspace.loadSnapshot('nominal_nuis')
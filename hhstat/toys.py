@@ -0,0 +1,69 @@
+# ---> root/rootpy imports
+from rootpy.io import root_open
+
+# ---> local imports
+from .extern import ToyMC
+from . import log; log = log[__name__]
+
+
+# ------------------------------------------------
+def toy_mc(ws, output,
+           n_toys=1000,
+           mode='cls',
+           mu_test=1.,
+           seed=1,
+           n_jobs=1,
+           batch=100,
+           flat_nll=False,
+           verbose=False):
+    """
+    Generate and fit toys with the ToyMC macro and write them to the ROOT file output.
+    Toys already in output (same mode, mu_test, seed) are kept and not refitted,
+    so an interrupted job can simply be run again.
+    - Parameters:
+    - ws: RooWorkspace
+    - output: name of the output ROOT file
+    - n_toys: number of toys per ensemble
+    - mode: 'cls' (qmu tilde, b and s+b toys) or 'p0' (q0, b toys)
+    - mu_test: tested mu in 'cls' mode
+    - seed: base seed, each toy is seeded from (seed, ensemble, toy)
+    - n_jobs: number of forked workers
+    - batch: number of toys between two autosaves of the toys tree
+    - flat_nll: fit the flattened binned likelihood (FlatBinnedNLL.h)
+    """
+    toys = ToyMC(ws, verbose)
+    toys.setMode(mode)
+    toys.setMuTest(mu_test)
+    toys.setToys(n_toys)
+    toys.setSeed(seed)
+    toys.setWorkers(n_jobs)
+    toys.setBatch(batch)
+    toys.setFlatNLL(flat_nll)
+    n_fitted = toys.run(output)
+    if n_fitted < 0:
+        raise RuntimeError("toy failure")
+    return n_fitted
+
+
+# ------------------------------------------------
+def get_toy_result(file_name):
+    """
+    Read the p-values and the throughput written by toy_mc,
+    undefined p-values are -1
+    """
+    with root_open(file_name) as file:
+        for entry in file.result:
+            return {
+                'mu_test': entry.mu_test,
+                'q_obs': entry.q_obs,
+                'mu_hat_obs': entry.mu_hat_obs,
+                'n_b': entry.n_b,
+                'n_sb': entry.n_sb,
+                'n_failed': entry.n_failed,
+                'cl_b': entry.cl_b,
+                'cl_sb': entry.cl_sb,
+                'cl_s': entry.cl_s,
+                'p0': entry.p0,
+                'toys_per_core_hour': entry.toys_per_core_hour,
+            }
+    return None